@@ -1,6 +1,7 @@
 // Copyright 2013
 // Author: Christopher Van Arsdale
 
+#include <cctype>
 #include <string>
 #include <vector>
 #include "common/base/flags.h"
@@ -18,7 +19,13 @@ DEFINE_bool(add_default_flags, true,
             "If false, we disable the default flags.");
 
 DEFINE_bool(enable_flto_object_files, true,
-            "If true, we enable -flto in the default flags.");
+            "If true, we enable link time optimization (see --lto) in the "
+            "default flags.");
+
+DEFINE_string(lto, "thin",
+              "Link time optimization mode for non-debug builds: \"off\", "
+              "\"thin\" (clang ThinLTO, cached in the object dir with lld or "
+              "ld64; gcc parallel LTO) or \"full\" (plain -flto).");
 
 DEFINE_bool(silent_make, true,
             "If false, make prints out commands before execution.");
@@ -49,20 +56,38 @@ DEFINE_string(binary_dir, "bin",
               "root dir).");
 
 DEFINE_bool(debug, false,
-            "If true, we disable optimizations.");
+            "If true, the default build configuration is dbg rather than "
+            "opt.");
+
+DEFINE_string(config, "",
+              "Build configuration make uses without CONFIG=<name>: opt, "
+              "dbg, asan or one declared with -C.<name>=... (etc). Defaults "
+              "to dbg with --debug, opt otherwise.");
 
 using std::string;
 
 namespace repobuild {
+namespace {
+const char kOptConfig[] = "opt";
+const char kDbgConfig[] = "dbg";
+const char kAsanConfig[] = "asan";
+}  // anonymous namespace
 
 Input::Input() {
   root_dir_ = FLAGS_root_dir;
   full_root_dir_ = strings::JoinPath(strings::CurrentPath(), root_dir_);
-  object_dir_ = FLAGS_object_dir;
+  object_dir_ = "$(OBJ_DIR)";
   genfile_dir_ = FLAGS_genfile_dir;
   source_dir_ = FLAGS_source_dir;
   pkgfile_dir_ = FLAGS_package_dir;
-  binary_dir_ = FLAGS_binary_dir;
+  binary_dir_ = "$(BIN_DIR)";
+  AddConfig(kOptConfig);
+  AddConfig(kDbgConfig);
+  AddConfig(kAsanConfig);
+  default_config_ = FLAGS_config;
+  if (default_config_.empty()) {
+    default_config_ = FLAGS_debug ? kDbgConfig : kOptConfig;
+  }
 
   // Default flags.
   if (FLAGS_add_default_flags) {
@@ -77,12 +102,6 @@ Input::Input() {
     AddFlag("-C", "-Wno-sign-compare");
     AddFlag("-C", "gcc=-Wno-unused-local-typedefs");
     AddFlag("-C", "gcc=-Wno-error=unused-local-typedefs");
-    if (!FLAGS_debug) {
-      AddFlag("-C", "-O3");
-      if (FLAGS_enable_flto_object_files) {
-        AddFlag("-C", "-flto");
-      }
-    }
     AddFlag("-C", "clang=-Qunused-arguments");
     AddFlag("-C", "clang=-fcolor-diagnostics");
 
@@ -90,22 +109,90 @@ Input::Input() {
     AddFlag("-L", "clang=-stdlib=libc++");
     AddFlag("-L", "-lpthread");
     AddFlag("-L", "-g");
-    if (!FLAGS_debug) {
-      AddFlag("-L", "-O3");
-      if (FLAGS_enable_flto_object_files) {
-        AddFlag("-L", "-flto");
-      }
-    }
     AddFlag("-L", "-L/usr/local/lib");
     AddFlag("-L", "-L/opt/local/lib");
 
     // Java compiler
     AddFlag("-JC", "-g");
+
+    // Configurations: opt is optimized, dbg is not, and asan is lightly
+    // optimized with AddressSanitizer.
+    AddFlag("-C.opt", "-O3");
+    AddFlag("-L.opt", "-O3");
+    if (FLAGS_enable_flto_object_files) {
+      AddLtoFlags("-C.opt");
+      AddLtoFlags("-L.opt");
+    }
+    AddFlag("-C.asan", "-O1");
+    AddFlag("-C.asan", "-fsanitize=address");
+    AddFlag("-C.asan", "-fno-omit-frame-pointer");
+    AddFlag("-L.asan", "-fsanitize=address");
   }
 
   silent_make_ = FLAGS_silent_make;
 }
 
+void Input::AddLtoFlags(const std::string& key) {
+  if (FLAGS_lto == "off") {
+    return;
+  } else if (FLAGS_lto == "full") {
+    AddFlag(key, "-flto");
+  } else if (FLAGS_lto == "thin") {
+    // ThinLTO summaries let clang optimize and cache each module
+    // separately at link time. gcc has no ThinLTO, but -flto=auto runs the
+    // link time backends in parallel (using make's jobserver if available).
+    AddFlag(key, "clang=-flto=thin");
+    if (strings::HasPrefix(key, "-C")) {
+      AddFlag(key, "gcc=-flto");
+    } else {
+      AddFlag(key, "gcc=-flto=auto");
+      AddFlag(key, "clang=-flto-jobs=0");
+      // Set by the make head, when the linker supports a cache.
+      AddFlag(key, "clang=$(THINLTO_CACHE)");
+    }
+  } else {
+    LOG(FATAL) << "Unknown --lto mode: " << FLAGS_lto;
+  }
+}
+
+void Input::AddFlag(const std::string& key, const std::string& value) {
+  size_t dot = key.find('.');
+  if (dot != string::npos) {
+    AddConfig(key.substr(dot + 1));
+  }
+  flags_[key].push_back(value);
+}
+
+void Input::AddConfig(const std::string& config) {
+  for (const string& existing : configs_) {
+    if (existing == config) {
+      return;
+    }
+  }
+  for (char c : config) {
+    LOG_IF(FATAL, !isalnum(c) && c != '_')
+        << "Invalid build configuration name: " << config;
+  }
+  LOG_IF(FATAL, config.empty()) << "Empty build configuration name.";
+  configs_.push_back(config);
+}
+
+// The first configuration (opt) keeps --object_dir and --binary_dir, the
+// others get <dir>-<config>.
+std::string Input::ConfigObjectDir(const std::string& config) const {
+  if (config == configs_[0]) {
+    return FLAGS_object_dir;
+  }
+  return FLAGS_object_dir + "-" + config;
+}
+
+std::string Input::ConfigBinaryDir(const std::string& config) const {
+  if (config == configs_[0]) {
+    return FLAGS_binary_dir;
+  }
+  return FLAGS_binary_dir + "-" + config;
+}
+
 const std::vector<std::string>& Input::flags(const std::string& key) const {
   auto it = flags_.find(key);
   if (it == flags_.end()) {
@@ -19,11 +19,13 @@ class Input {
 
   // Mutators:
   void AddBuildTarget(const TargetInfo& target);
-  void AddFlag(const std::string& key, const std::string& value) {
-    flags_[key].push_back(value);
-  }
+  // Keys may name a build configuration, e.g. "-C.asan" adds a compile flag
+  // to (and declares, if new) the "asan" configuration.
+  void AddFlag(const std::string& key, const std::string& value);
 
   // Accessors
+  // NB: object_dir() and binary_dir() are make variables, $(OBJ_DIR) and
+  // $(BIN_DIR), which depend on the build configuration make runs with.
   const std::string& root_dir() const { return root_dir_; }
   const std::string& full_root_dir() const { return full_root_dir_; }
   const std::string& object_dir() const { return object_dir_; }
@@ -40,7 +42,18 @@ class Input {
   }
   bool silent_make() const { return silent_make_; }
 
+  // Build configurations ("make CONFIG=<name>"), each with its own flags
+  // (see flags(<key>.<name>)) and output directories.
+  const std::vector<std::string>& configs() const { return configs_; }
+  const std::string& default_config() const { return default_config_; }
+  std::string ConfigObjectDir(const std::string& config) const;
+  std::string ConfigBinaryDir(const std::string& config) const;
+
  private:
+  // Adds the default link time optimization flags (--lto) to key.
+  void AddLtoFlags(const std::string& key);
+  void AddConfig(const std::string& config);
+
   std::string root_dir_;
   std::string full_root_dir_;
   std::string object_dir_;
@@ -52,6 +65,8 @@ class Input {
   std::vector<TargetInfo> build_targets_;
   std::set<std::string> build_target_set_;
   std::map<std::string, std::vector<std::string> > flags_;
+  std::vector<std::string> configs_;
+  std::string default_config_;
 
   bool silent_make_;
 };
@@ -1,10 +1,13 @@
 // Copyright 2013
 // Author: Christopher Van Arsdale
 
+#include <algorithm>
 #include <iostream>
+#include <map>
 #include <set>
 #include <vector>
 #include <string>
+#include <utility>
 #include "common/base/flags.h"
 #include "common/log/log.h"
 #include "common/strings/strutil.h"
@@ -14,9 +17,12 @@
 #include "repobuild/env/resource.h"
 #include "repobuild/generator/generator.h"
 #include "repobuild/nodes/allnodes.h"
+#include "repobuild/nodes/execute_test.h"
 #include "repobuild/nodes/node.h"
 #include "repobuild/reader/parser.h"
 
+using std::map;
+using std::pair;
 using std::string;
 using std::vector;
 using std::set;
@@ -51,6 +57,60 @@ void ExpandNode(const Parser& parser,
   to_process->push_back(node);
 }
 
+// Build configurations, "make CONFIG=<name>". Each has its own output
+// directories, so switching between them rebuilds nothing that was already
+// built. Their flags are set up with the compiler flags (cc_library).
+void WriteConfigs(const Input& input, Makefile* out) {
+  const vector<string>& configs = input.configs();
+  if (std::find(configs.begin(), configs.end(), input.default_config()) ==
+      configs.end()) {
+    LOG(FATAL) << "Unknown build configuration (--config): "
+               << input.default_config();
+  }
+  out->append("CONFIG ?= " + input.default_config() + "\n");
+  for (int i = 0; i < configs.size(); ++i) {
+    out->append(string(i == 0 ? "" : "else ") +
+                "ifeq ($(CONFIG)," + configs[i] + ")\n");
+    out->append("\tOBJ_DIR := " + input.ConfigObjectDir(configs[i]) + "\n");
+    out->append("\tBIN_DIR := " + input.ConfigBinaryDir(configs[i]) + "\n");
+  }
+  out->append("else\n");
+  out->append("$(error Unknown CONFIG=$(CONFIG), expected one of: " +
+              strings::JoinAll(configs, " ") + ")\n");
+  out->append("endif\n\n");
+}
+
+// make -j starts prerequisites in order as jobs finish, so listing the
+// longest tests first packs them into the job slots (longest processing
+// time first) instead of leaving a slow test to run alone at the end.
+// Their recorded run times are only known when make runs (see
+// TESTS_LONGEST_FIRST in ExecuteTestNode::WriteMakeHead); here each test
+// gets its type's default time, as "<seconds>:<test>" in that order.
+vector<string> DefaultTestTimes(const vector<const Node*>& nodes,
+                                const set<string>& tests) {
+  map<string, int> default_seconds;
+  for (const Node* node : nodes) {
+    if (node->IncludeInTests()) {
+      default_seconds[node->target().make_path()] =
+          node->DefaultTestSeconds();
+    }
+  }
+
+  vector<pair<int, string> > sorted;
+  for (const string& test : tests) {
+    auto it = default_seconds.find(test);
+    int seconds = (it == default_seconds.end() ? 0 : it->second);
+    sorted.push_back(std::make_pair(-seconds, test));
+  }
+  std::sort(sorted.begin(), sorted.end());
+
+  vector<string> ordered;
+  for (const auto& it : sorted) {
+    ordered.push_back(std::to_string(-it.first) + ":" + it.second);
+  }
+  return ordered;
+}
+
 }  // anonymous namespace
 
 Generator::Generator(DistSource* source)
@@ -68,6 +128,7 @@ string Generator::GenerateMakefile(const Input& input) {
   Makefile out(input.root_dir(), input.genfile_dir());
   out.SetSilent(input.silent_make());
   out.append("# Auto-generated by repobuild, do not modify directly.\n\n");
+  WriteConfigs(input, &out);
   builder_set.WriteMakeHead(input, &out);
   source_->WriteMakeHead(input, &out);
 
@@ -84,7 +145,10 @@ string Generator::GenerateMakefile(const Input& input) {
 
   std::cout << "Generating: Makefile" << std::endl;
 
-  // Generate the makefile.
+  // Generate the makefile: all variables, then all rules.
+  for (const Node* node : process_order) {
+    node->WriteMakeVariables(&out);
+  }
   for (const Node* node : process_order) {
     VLOG(1) << "Writing make: " << node->target().full_path();
     node->WriteMake(&out);
@@ -102,8 +166,10 @@ string Generator::GenerateMakefile(const Input& input) {
     node->WriteMakeClean(clean);
   }
   source_->WriteMakeClean(clean);
-  clean->WriteCommand("rm -rf " + input.object_dir());
-  clean->WriteCommand("rm -rf " + input.binary_dir());
+  for (const string& config : input.configs()) {
+    clean->WriteCommand("rm -rf " + input.ConfigObjectDir(config));
+    clean->WriteCommand("rm -rf " + input.ConfigBinaryDir(config));
+  }
   clean->WriteCommand("rm -rf " + input.genfile_dir());
   clean->WriteCommand("rm -rf " + input.source_dir());
   clean->WriteCommand("rm -rf " + input.pkgfile_dir());
@@ -144,7 +210,30 @@ string Generator::GenerateMakefile(const Input& input) {
       node->FinalTests(Node::NO_LANG, &tests);
     }
   }
-  out.WriteRule("tests", strings::JoinAll(tests, " "));
+  // Ordering runs a shell, so only when the tests are what we are making.
+  out.append("TEST_SECONDS := " + strings::JoinAll(
+      DefaultTestTimes(process_order, tests), " ") + "\n");
+  out.WriteRule("tests", "$(if $(filter tests,$(MAKECMDGOALS)),"
+                "$(TESTS_LONGEST_FIRST)," +
+                strings::JoinAll(tests, " ") + ")");
+
+  // Write the benchmark rule. Benchmarks are timed, so once their binaries
+  // are built (in parallel) a serial sub-make runs them one at a time.
+  set<string> benchmarks;
+  ResourceFileSet benchmark_binaries;
+  for (const Node* node : parser.input_nodes()) {
+    if (node->IncludeInBenchmarks()) {
+      benchmarks.insert(node->target().make_path());
+      node->Binaries(Node::NO_LANG, &benchmark_binaries);
+    }
+  }
+  Makefile::Rule* benchmark_rule = out.StartRawRule(
+      "benchmarks", strings::JoinAll(benchmark_binaries.files(), " "));
+  if (!benchmarks.empty()) {
+    benchmark_rule->WriteCommand("$(MAKE) -j1 " +
+                                 strings::JoinAll(benchmarks, " "));
+  }
+  out.FinishRule(benchmark_rule);
 
   // Write the licences rule.
   Makefile::Rule* license_rule = out.StartRawRule("licenses", "");
@@ -169,8 +258,21 @@ string Generator::GenerateMakefile(const Input& input) {
   }
   out.FinishRule(license_rule);
 
+  // Shortcuts for other configurations, e.g. "make tests.asan".
+  set<string> config_targets;
+  for (const string& config : input.configs()) {
+    for (string name : {"all", "tests", "benchmarks"}) {
+      string config_target = name + "." + config;
+      Makefile::Rule* rule = out.StartRawRule(config_target, "");
+      rule->WriteCommand("$(MAKE) CONFIG=" + config + " " + name);
+      out.FinishRule(rule);
+      config_targets.insert(config_target);
+    }
+  }
+
   // Not real files:
-  out.append(".PHONY: clean all tests install licenses\n\n");
+  out.append(".PHONY: clean all tests benchmarks install licenses " +
+             strings::JoinAll(config_targets, " ") + "\n\n");
 
   // Default build everything.
   out.append(".DEFAULT_GOAL=all\n\n");
@@ -9,6 +9,7 @@
 #include "repobuild/nodes/cmake.h"
 #include "repobuild/nodes/node.h"
 #include "repobuild/nodes/cc_library.h"
+#include "repobuild/nodes/cc_benchmark.h"
 #include "repobuild/nodes/cc_binary.h"
 #include "repobuild/nodes/cc_embed_data.h"
 #include "repobuild/nodes/cc_shared_library.h"
@@ -83,6 +84,7 @@ void NodeBuilder::GetAll(std::vector<NodeBuilder*>* nodes) {
       "cc_shared_library"));
   nodes->push_back(new NodeBuilderImplHead<PyBinaryNode>("py_egg"));
   nodes->push_back(new NodeBuilderImplHead<CCEmbedDataNode>("cc_embed_data"));
+  nodes->push_back(new NodeBuilderImplHead<CCBenchmarkNode>("cc_benchmark"));
 
   nodes->push_back(new NodeBuilderImpl<AutoconfNode>("autoconf"));
   nodes->push_back(new NodeBuilderImpl<CCBinaryNode>("cc_binary"));
@@ -90,7 +92,7 @@ void NodeBuilder::GetAll(std::vector<NodeBuilder*>* nodes) {
   nodes->push_back(new NodeBuilderImpl<ConfigNode>("config"));
   nodes->push_back(new NodeBuilderImpl<GoLibraryNode>("go_library"));
   nodes->push_back(new NodeBuilderImpl<GoBinaryNode>("go_binary"));
-  nodes->push_back(new NodeBuilderImpl<JavaLibraryNode>("java_library"));
+  nodes->push_back(new NodeBuilderImplHead<JavaLibraryNode>("java_library"));
   nodes->push_back(new NodeBuilderImpl<JavaJarNode>("java_jar"));
   nodes->push_back(new NodeBuilderImpl<JavaBinaryNode>("java_binary"));
   nodes->push_back(new NodeBuilderImpl<MakeNode>("make"));
@@ -101,13 +103,13 @@ void NodeBuilder::GetAll(std::vector<NodeBuilder*>* nodes) {
 
   nodes->push_back(new NodeBuilderImplFinish<PyLibraryNode>("py_library"));
 
-  // Test nodes
-  nodes->push_back(new NodeBuilderImpl<ExecuteTestNodeImpl<CCBinaryNode> >(
-      "cc_test"));
-  nodes->push_back(new NodeBuilderImpl<ExecuteTestNodeImpl<PyBinaryNode> >(
-      "py_test"));
-  nodes->push_back(new NodeBuilderImpl<ExecuteTestNodeImpl<JavaBinaryNode> >(
-      "java_test"));
+  // Test nodes. cc_test writes the head shared by every test node.
+  nodes->push_back(new NodeBuilderImplHead<
+      ExecuteTestNodeImpl<CCBinaryNode, kCCTestSeconds, true> >("cc_test"));
+  nodes->push_back(new NodeBuilderImpl<
+      ExecuteTestNodeImpl<PyBinaryNode, kPyTestSeconds> >("py_test"));
+  nodes->push_back(new NodeBuilderImpl<
+      ExecuteTestNodeImpl<JavaBinaryNode, kJavaTestSeconds> >("java_test"));
   nodes->push_back(new NodeBuilderImpl<GoTestNode>("go_test"));
 }
 
@@ -30,25 +30,27 @@ const char kCxxGcc[] = "CXX_GCC";
 void AutoconfNode::Parse(BuildFile* file, const BuildFileNode& input) {
   Node::Parse(file, input);
 
-  // configure_env
+  // configure_env (makefile text, as is everything below)
   vector<string> configure_env, gcc_configure_env, clang_configure_env;
-  current_reader()->ParseRepeatedString("configure_env", &configure_env);
-  current_reader()->ParseRepeatedString("gcc.configure_env",
-                                        &gcc_configure_env);
-  current_reader()->ParseRepeatedString("clang.configure_env",
-                                        &clang_configure_env);
+  current_reader()->ParseRepeatedMakeString("configure_env", false,
+                                            &configure_env);
+  current_reader()->ParseRepeatedMakeString("gcc.configure_env", false,
+                                            &gcc_configure_env);
+  current_reader()->ParseRepeatedMakeString("clang.configure_env", false,
+                                            &clang_configure_env);
 
   // configure_args
   vector<string> configure_args, gcc_configure_args, clang_configure_args;
-  current_reader()->ParseRepeatedString("configure_args", &configure_args);
-  current_reader()->ParseRepeatedString("gcc.configure_args",
-                                        &gcc_configure_args);
-  current_reader()->ParseRepeatedString("clang.configure_args",
-                                        &clang_configure_args);
+  current_reader()->ParseRepeatedMakeString("configure_args", false,
+                                            &configure_args);
+  current_reader()->ParseRepeatedMakeString("gcc.configure_args", false,
+                                            &gcc_configure_args);
+  current_reader()->ParseRepeatedMakeString("clang.configure_args", false,
+                                            &clang_configure_args);
 
   // configure
   string configure;
-  current_reader()->ParseStringField("configure_cmd", true, &configure);
+  current_reader()->ParseMakeStringField("configure_cmd", true, &configure);
   if (configure.empty()) {
     configure = "./configure";
   }
@@ -58,7 +60,7 @@ void AutoconfNode::Parse(BuildFile* file, const BuildFileNode& input) {
   gen->SetMakeName("Autoconf");
   
   // Env
-  AddConditionalVariable(
+  AddConditionalMakeVariable(
       kConfigureEnv, kCxxGcc,
       strings::JoinWith(
           " ",
@@ -70,7 +72,7 @@ void AutoconfNode::Parse(BuildFile* file, const BuildFileNode& input) {
           strings::JoinAll(clang_configure_env, " ")));
 
   // Args
-  AddConditionalVariable(
+  AddConditionalMakeVariable(
       kConfigureArgs, kCxxGcc,
       strings::JoinWith(
           " ",
@@ -93,15 +95,14 @@ void AutoconfNode::Parse(BuildFile* file, const BuildFileNode& input) {
           "CC=\"$CC\" "
           "CXX=\"$CXX\"");
   string configure_cmd =
-      Makefile::Escape(configure +
-                       " --prefix=/ --cache-file=$GEN_DIR/config.cache ") +
+      configure +
+      Makefile::Escape(" --prefix=/ --cache-file=$GEN_DIR/config.cache ") +
       GetVariable(kConfigureArgs).ref_name();
   vector<Resource> input_files, output_files;
   gen->Set(build_setup + "; " + build_env + " " + configure_cmd,
            "",  // clean
            input_files,
            output_files);
-  gen->SetMakefileEscape(false);  // we do it ourselves
 
   // Make output --------------------------
   MakeNode* make = NewSubNode<MakeNode>(file);
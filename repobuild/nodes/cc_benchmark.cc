@@ -0,0 +1,183 @@
+// Copyright 2013
+// Author: Christopher Van Arsdale
+
+#include <memory>
+#include <string>
+#include <vector>
+#include "common/log/log.h"
+#include "common/strings/path.h"
+#include "common/strings/strutil.h"
+#include "repobuild/env/input.h"
+#include "repobuild/env/resource.h"
+#include "repobuild/nodes/cc_benchmark.h"
+#include "repobuild/nodes/cc_binary.h"
+#include "repobuild/reader/buildfile.h"
+
+using std::string;
+using std::vector;
+
+namespace repobuild {
+namespace {
+string CompareScript(const Input& input) {
+  return strings::JoinPath(input.genfile_dir(), "benchmark_compare.pl");
+}
+}
+
+CCBenchmarkNode::CCBenchmarkNode(const TargetInfo& target,
+                                 const Input& input,
+                                 DistSource* source)
+    : Node(target.GetParallelTarget(target.local_path() + ".benchmark"),
+           input,
+           source),
+      orig_target_(target),
+      repetitions_(5),
+      threshold_percent_(5) {
+}
+
+void CCBenchmarkNode::Parse(BuildFile* file, const BuildFileNode& input) {
+  // binary node
+  Node* subnode = new CCBinaryNode(orig_target_,
+                                   Node::input(),
+                                   Node::dist_source());
+  subnode->Parse(file, input);
+  AddSubNode(subnode);
+
+  ResourceFileSet binaries;
+  subnode->TopTestBinaries(NO_LANG, &binaries);
+  CHECK_EQ(1, binaries.files().size()) << target().full_path();
+  binary_ = binaries.files()[0];
+  results_ = Resource::FromLocalPath(
+      ObjectDir(), orig_target_.local_path() + ".benchmark.json");
+
+  // benchmark options.
+  std::unique_ptr<BuildFileNodeReader> reader(NewBuildReader(input));
+  reader->ParseRepeatedString("benchmark_args", &benchmark_args_);
+  reader->ParseIntField("repetitions", &repetitions_);
+  reader->ParseIntField("threshold_percent", &threshold_percent_);
+  if (repetitions_ < 1 || threshold_percent_ < 0) {
+    LOG(FATAL) << "cc_benchmark " << target().full_path()
+               << " needs repetitions >= 1 and threshold_percent >= 0.";
+  }
+  string baseline = orig_target_.local_path() + ".baseline.json";
+  reader->ParseStringField("baseline", &baseline);
+  baseline_ = strings::JoinPath(orig_target_.dir(), baseline);
+}
+
+void CCBenchmarkNode::LocalWriteMake(Makefile* out) const {
+  // The baseline is optional, and BENCHMARK_UPDATE_BASELINE=1 reruns
+  // everything to record a new one.
+  Makefile::Rule* rule = out->StartRule(
+      results_.path(),
+      strings::JoinWith(" ", binary_.path(), CompareScript(input()),
+                        "$(wildcard " + baseline_ + ")",
+                        "$(BENCHMARK_FORCE)"));
+  rule->WriteUserEcho("Benchmark", orig_target_.make_path());
+  rule->WriteCommand("mkdir -p " + results_.dirname());
+  rule->WriteCommand(
+      strings::JoinWith(
+          " ",
+          binary_.path(),
+          strings::StringPrintf("--benchmark_repetitions=%d", repetitions_),
+          "--benchmark_report_aggregates_only=true",
+          "--benchmark_out_format=json",
+          "--benchmark_out=$@.tmp",
+          strings::JoinAll(benchmark_args_, " ")));
+  rule->WriteCommand(
+      strings::JoinWith(
+          " ",
+          CompareScript(input()), "$@.tmp", baseline_,
+          strings::StringPrintf("%d", threshold_percent_),
+          "$(BENCHMARK_UPDATE_BASELINE)"));
+  // Only passing results are kept, so a regression fails every run until
+  // it is fixed (or the baseline updated).
+  rule->WriteCommand("mv -f $@.tmp $@");
+  out->FinishRule(rule);
+
+  ResourceFileSet files;
+  files.Add(results_);
+  WriteBaseUserTarget(files, out);
+}
+
+// static
+void CCBenchmarkNode::WriteMakeHead(const Input& input, Makefile* out) {
+  const char kCompareScript[] =
+    "#!/usr/bin/perl\n"
+    "# benchmark_compare.pl <results> <baseline> <threshold percent> [update]\n"
+    "# Compares google benchmark json results against a baseline by cpu time,\n"
+    "# using the median of repeated runs when there is one.\n"
+    "use strict;\n"
+    "use warnings;\n"
+    "use File::Copy;\n"
+    "use JSON::PP;\n"
+    "\n"
+    "my ($results, $baseline, $threshold, $update) = @ARGV;\n"
+    "my %kUnits = (ns => 1, us => 1e3, ms => 1e6, s => 1e9);\n"
+    "\n"
+    "sub Load {\n"
+    "    my ($file) = @_;\n"
+    "    open(my $fh, \"<\", $file) || die(\"$file: $!\\n\");\n"
+    "    local $/;\n"
+    "    my $json = decode_json(<$fh>);\n"
+    "    close($fh);\n"
+    "    my (%median, %single);\n"
+    "    for my $run (@{$json->{benchmarks} || []}) {\n"
+    "        my $name = $run->{run_name} || $run->{name};\n"
+    "        my $unit = $kUnits{$run->{time_unit} || \"ns\"} || 1;\n"
+    "        my $ns = $run->{cpu_time} * $unit;\n"
+    "        my $type = $run->{run_type} || \"iteration\";\n"
+    "        if ($type eq \"aggregate\") {\n"
+    "            my $aggregate = $run->{aggregate_name} || \"\";\n"
+    "            $median{$name} = $ns if $aggregate eq \"median\";\n"
+    "        } elsif (!defined($single{$name}) || $ns < $single{$name}) {\n"
+    "            $single{$name} = $ns;\n"
+    "        }\n"
+    "    }\n"
+    "    return { %single, %median };\n"
+    "}\n"
+    "\n"
+    "if ($update) {\n"
+    "    copy($results, $baseline) || die(\"$baseline: $!\\n\");\n"
+    "    print \"Updated $baseline\\n\";\n"
+    "    exit(0);\n"
+    "}\n"
+    "if (!-e $baseline) {\n"
+    "    print \"No baseline $baseline, record one with \" .\n"
+    "        \"\\\"make benchmarks BENCHMARK_UPDATE_BASELINE=1\\\".\\n\";\n"
+    "    exit(0);\n"
+    "}\n"
+    "\n"
+    "my $new = Load($results);\n"
+    "my $old = Load($baseline);\n"
+    "my $regressions = 0;\n"
+    "printf(\"%-50s %14s %14s %8s\\n\",\n"
+    "       \"Benchmark\", \"Baseline (ns)\", \"Now (ns)\", \"Change\");\n"
+    "for my $name (sort(keys(%$new))) {\n"
+    "    if (!defined($old->{$name}) || $old->{$name} <= 0) {\n"
+    "        printf(\"%-50s %14s %14.1f %8s\\n\",\n"
+    "               $name, \"-\", $new->{$name}, \"new\");\n"
+    "        next;\n"
+    "    }\n"
+    "    my $change = 100 * ($new->{$name} - $old->{$name}) / $old->{$name};\n"
+    "    my $regressed = $change > $threshold;\n"
+    "    $regressions++ if $regressed;\n"
+    "    printf(\"%-50s %14.1f %14.1f %+7.1f%%%s\\n\",\n"
+    "           $name, $old->{$name}, $new->{$name}, $change,\n"
+    "           $regressed ? \"  REGRESSION\" : \"\");\n"
+    "}\n"
+    "if ($regressions) {\n"
+    "    print STDERR \"$regressions benchmark(s) more than $threshold% \" .\n"
+    "        \"slower than $baseline, results in $results\\n\";\n"
+    "    exit(1);\n"
+    "}\n";
+  out->GenerateExecFile("BenchmarkCompare", CompareScript(input),
+                        kCompareScript);
+
+  // make benchmarks BENCHMARK_UPDATE_BASELINE=1
+  out->append("BENCHMARK_UPDATE_BASELINE ?=\n");
+  out->append("BENCHMARK_FORCE := $(if $(BENCHMARK_UPDATE_BASELINE),"
+              "FORCE_BENCHMARKS)\n");
+  out->append("FORCE_BENCHMARKS:\n\n");
+  out->append(".PHONY: FORCE_BENCHMARKS\n\n");
+}
+
+}  // namespace repobuild
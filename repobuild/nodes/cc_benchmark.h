@@ -0,0 +1,46 @@
+// Copyright 2013
+// Author: Christopher Van Arsdale
+
+#ifndef _REPOBUILD_NODES_CC_BENCHMARK_H__
+#define _REPOBUILD_NODES_CC_BENCHMARK_H__
+
+#include <string>
+#include <vector>
+#include "repobuild/env/resource.h"
+#include "repobuild/nodes/node.h"
+#include "repobuild/reader/buildfile.h"
+
+namespace repobuild {
+
+// A cc_binary using google benchmark, run by "make benchmarks" (one at a
+// time, whatever -j is). Results (medians of "repetitions" runs) go to a
+// json file in the object dir, and are compared against "baseline" (default
+// <name>.baseline.json): any benchmark more than "threshold_percent" slower
+// fails the build.
+class CCBenchmarkNode : public Node {
+ public:
+  CCBenchmarkNode(const TargetInfo& target,
+                  const Input& input,
+                  DistSource* source);
+  virtual ~CCBenchmarkNode() {}
+  virtual void Parse(BuildFile* file, const BuildFileNode& input);
+
+  virtual bool IncludeInAll() const { return false; }
+  virtual bool IncludeInBenchmarks() const { return true; }
+  virtual void LocalWriteMake(Makefile* out) const;
+
+  static void WriteMakeHead(const Input& input, Makefile* out);
+
+ private:
+  TargetInfo orig_target_;
+  Resource binary_;
+  Resource results_;
+  std::string baseline_;
+  std::vector<std::string> benchmark_args_;
+  int repetitions_;
+  int threshold_percent_;
+};
+
+}  // namespace repobuild
+
+#endif  // _REPOBUILD_NODES_CC_BENCHMARK_H__
@@ -12,6 +12,7 @@
 #include "common/strings/path.h"
 #include "repobuild/env/input.h"
 #include "repobuild/nodes/cc_binary.h"
+#include "repobuild/nodes/makefile.h"
 #include "repobuild/nodes/top_symlink.h"
 #include "repobuild/reader/buildfile.h"
 
@@ -20,9 +21,28 @@ using std::vector;
 using std::set;
 
 namespace repobuild {
+namespace {
+const char kCxxGcc[] = "CXX_GCC";
+const char kPgoGenerateArgs[] = "pgo_generate_args";
+const char kPgoUseArgs[] = "pgo_use_args";
+const char kPgoMerge[] = "pgo_merge";
+}
 
 void CCBinaryNode::Parse(BuildFile* file, const BuildFileNode& input) {
   CCLibraryNode::Parse(file, input);
+
+  // pgo_training
+  vector<string> pgo_training;
+  current_reader()->ParseRepeatedString("pgo_training", &pgo_training);
+  for (const string& training : pgo_training) {
+    TargetInfo training_target = file->ComputeTargetInfo(training);
+    AddDependencyTarget(training_target);
+    pgo_training_.insert(training_target.full_path());
+  }
+  if (!pgo_training_.empty()) {
+    InitPgo();
+  }
+
   ResourceFileSet binaries;
   LocalBinaries(NO_LANG, &binaries);
   AddSubNode(new TopSymlinkNode(
@@ -36,76 +56,193 @@ void CCBinaryNode::LocalWriteMake(Makefile* out) const {
   CCLibraryNode::LocalWriteMakeInternal(false, out);
   WriteLink(ObjBinary(), out);
   WriteBaseUserTarget(out);
+  if (!pgo_training_.empty()) {
+    WritePgo(out);
+  }
 }
 
-/**
- * Adds to "has_tag" each Resource in "fileset" that has "tag".
- * Adds to "no_tag" each Resource in "fileset" that does not have "tag".
- */
-static void Partition(const ResourceFileSet& fileset,
-		      const string& tag,
-		      ResourceFileSet* has_tag,
-		      ResourceFileSet* no_tag) {
-  for (auto it : fileset) {
-    if (it.has_tag(tag)) {
-      has_tag->Add(it);
-    } else {
-      no_tag->Add(it);
+// Profile guided optimization, in three stages with their own directories
+// under .gen-obj/pgo/<binary>:
+//  instrument/ The pgo_training binaries, built with profiling.
+//  profile/    Profiles from running them (merged.profdata for clang).
+//  optimize/   Our objects, built with the profiles; linked as
+//              .gen-obj/<binary>.pgo.
+// gcc reads each object's profile (.gcda) from next to the object, so
+// merging copies the instrument/ profiles over to optimize/. clang profiles
+// are merged with $LLVM_PROFDATA (default llvm-profdata).
+void CCBinaryNode::InitPgo() {
+  string pgo_dir = PgoDir();
+  string instrument_dir = strings::JoinPath(pgo_dir, "instrument");
+  string profile_dir = strings::JoinPath(pgo_dir, "profile");
+  // Our paths are under $(OBJ_DIR): makefile text.
+  AddConditionalMakeVariable(
+      kPgoGenerateArgs, kCxxGcc,
+      "-fprofile-generate -fprofile-update=atomic",
+      "-fprofile-generate=" + profile_dir);
+  AddConditionalMakeVariable(
+      kPgoUseArgs, kCxxGcc,
+      "-fprofile-use -fprofile-partial-training -Wno-missing-profile",
+      "-fprofile-use=" + strings::JoinPath(profile_dir, "merged.profdata") +
+      " -Wno-profile-instr-unprofiled -Wno-profile-instr-out-of-date");
+  AddConditionalMakeVariable(
+      kPgoMerge, kCxxGcc,
+      "mkdir -p " + strings::JoinPath(pgo_dir, "optimize") + " && "
+      "cd " + instrument_dir + " && "
+      "find . -name '*.gcda' -exec cp --parents {} ../optimize \\;",
+      Makefile::Escape("${LLVM_PROFDATA:-llvm-profdata}") +
+      " merge -output=" +
+      strings::JoinPath(profile_dir, "merged.profdata") + " " +
+      strings::JoinPath(profile_dir, "*.profraw"));
+}
+
+void CCBinaryNode::WritePgo(Makefile* out) const {
+  string pgo_dir = PgoDir();
+  string instrument_dir = strings::JoinPath(pgo_dir, "instrument");
+  string optimize_dir = strings::JoinPath(pgo_dir, "optimize");
+  string profile_dir = strings::JoinPath(pgo_dir, "profile");
+  string generate_args = GetVariable(kPgoGenerateArgs).ref_name();
+  string use_args = GetVariable(kPgoUseArgs).ref_name();
+
+  // Stage 1: instrumented training binaries.
+  set<const CCLibraryNode*> instrumented;
+  ResourceFileSet trainers;
+  for (const Node* dep : dependencies()) {
+    if (pgo_training_.count(dep->target().full_path()) == 0) {
+      continue;
+    }
+    const CCBinaryNode* binary = PgoTrainingBinary(dep);
+    vector<const CCLibraryNode*> libraries;
+    PgoLibraries(binary, &libraries);
+    ResourceFileSet objects;
+    for (const CCLibraryNode* library : libraries) {
+      if (instrumented.insert(library).second) {
+        library->WriteVariantCompiles(instrument_dir, generate_args, "", out);
+      }
+      library->VariantObjectFiles(instrument_dir, &objects);
+    }
+    set<string> flags;
+    binary->LinkFlags(CPP, &flags);
+    flags.insert(generate_args);
+    Resource trainer = Resource::FromLocalPath(
+        instrument_dir, binary->target().make_path());
+    WriteLink(trainer, objects, flags, out);
+    trainers.Add(trainer);
+  }
+
+  // Stage 2: training. Stale profiles from earlier runs are removed first.
+  Resource profile = Resource::FromLocalPath(profile_dir, ".trained");
+  Makefile::Rule* rule = out->StartRule(
+      profile.path(), strings::JoinAll(trainers.files(), " "));
+  rule->WriteCommand("rm -rf " + profile_dir);
+  rule->WriteCommand("find " + pgo_dir + " -name '*.gcda' -delete");
+  rule->WriteCommand("mkdir -p " + profile_dir);
+  for (const Resource& trainer : trainers) {
+    rule->WriteUserEcho("Training", trainer.path());
+    rule->WriteCommand(trainer.path());
+  }
+  rule->WriteCommand(GetVariable(kPgoMerge).ref_name());
+  rule->WriteCommand("touch " + profile.path());
+  out->FinishRule(rule);
+
+  // Stage 3: optimized binary.
+  vector<const CCLibraryNode*> libraries;
+  PgoLibraries(this, &libraries);
+  ResourceFileSet objects;
+  for (const CCLibraryNode* library : libraries) {
+    library->WriteVariantCompiles(optimize_dir, use_args, profile.path(), out);
+    library->VariantObjectFiles(optimize_dir, &objects);
+  }
+  set<string> flags;
+  LinkFlags(CPP, &flags);
+  flags.insert(use_args);
+  Resource optimized = Resource::FromRootPath(ObjBinary().path() + ".pgo");
+  WriteLink(optimized, objects, flags, out);
+
+  // User target, "make path/to/exec.pgo".
+  out->WriteRule(target().make_path() + ".pgo", optimized.path());
+  out->append(".PHONY: " + target().make_path() + ".pgo\n\n");
+}
+
+string CCBinaryNode::PgoDir() const {
+  return strings::JoinPath(strings::JoinPath(input().object_dir(), "pgo"),
+                           target().make_path());
+}
+
+const CCBinaryNode* CCBinaryNode::PgoTrainingBinary(const Node* node) const {
+  // cc_binary, or the binary of a cc_test.
+  const CCBinaryNode* binary = dynamic_cast<const CCBinaryNode*>(node);
+  for (int i = 0; binary == NULL && i < node->dependencies().size(); ++i) {
+    binary = dynamic_cast<const CCBinaryNode*>(node->dependencies()[i]);
+  }
+  if (binary == NULL) {
+    LOG(FATAL) << "pgo_training of " << target().full_path() << ": "
+               << node->target().full_path()
+               << " is not a cc_binary or cc_test.";
+  }
+  return binary;
+}
+
+void CCBinaryNode::PgoLibraries(const CCBinaryNode* binary,
+                                vector<const CCLibraryNode*>* libs) const {
+  vector<Node*> all_deps;
+  binary->CollectAllDependencies(OBJECT_FILES, CPP, &all_deps);
+  for (const Node* node : all_deps) {
+    const CCLibraryNode* library = dynamic_cast<const CCLibraryNode*>(node);
+    if (library != NULL) {
+      libs->push_back(library);
     }
   }
+  libs->push_back(binary);
 }
 
 /**
- * This is a hack to inject some information into the compiled binary.
- * As it edits the binary it needs to keep existing bytes in place, i.e when
- * doing some replacement we should replace the target string with
- *  a string of the same length
+ * Binaries linking common/base/build-timestamp.c carry fixed size
+ * placeholders for the build user and time, which are overwritten in place
+ * with the linkstamp values: NUL terminated and padded to the placeholder's
+ * size. Only the placeholder bytes are written (the file is opened
+ * read/write, not rewritten), and only binaries linking that object are
+ * stamped at all. The placeholders are spelled as regexes here, so that a
+ * repobuild built by its own Makefile is not rewritten.
  */
-const string MakeBuildTimestampCommand(const string& command,
-                                        const string& placeholder,
-                                        const Resource& file) {
-  // +2 for "XX"
-  // +2 for \x0 as being a NUL
-  string placeholder_size = std::to_string(placeholder.length() + 2 + 2);
-  // The solution below use sprintf to do the padding (guarantee same length)
-  // then substr to truncate the string to the exact length in case it exceeds
-  string res = "DATA=\"$(shell "
-      "perl -e 'my $$s = `" + command + "`; chomp $$s;"
-      // C++ literal "\\\\x0" becomes "\\" perl literal becomes "\x0" for sed
-      " $$s=sprintf(\"%s\\\\x0\",$$s); "
-      " $$s=sprintf(\"%-" + placeholder_size + "s\",$$s); "
-      " $$s=substr($$s,0," + placeholder_size + "); print $$s')\";"
-      " sed -i -e \"s/XX" + placeholder + "/$$DATA/\" " + file.path();
-  return res;
-}
-
-// These must match the repobuild/common/base/build-timestamp.c MINUS
-// the initial "XX" that is moved to MakeBuildTimestampCommand().
-// This move is necessary so that Makefiles generated by repobuild don't
-// modify repobuild itself when using a repobuild-generated Makefile
-// to build repobuild.
-static const char *build_user      = "XXXXXXXX_BUILD_USER_XXXXXXXXXX";
-static const char *build_timestamp = "XXXXXX_BUILD_TIMESTAMP_XXXXXXX";
+static bool LinksBuildTimestamp(const ResourceFileSet& objects) {
+  for (const Resource& r : objects) {
+    if (r.basename().compare(0, 16, "build-timestamp.") == 0) {
+      return true;
+    }
+  }
+  return false;
+}
+
+static string StampPlaceholdersCommand(const Resource& file) {
+  return "LINKSTAMP_USER=\"$(LINKSTAMP_USER)\" "
+      "LINKSTAMP_TIMESTAMP=\"$(LINKSTAMP_TIMESTAMP)\" "
+      "perl -e '"
+      "open(my $$f, \"+<\", $$ARGV[0]) || die(\"$$ARGV[0]: $$!\\n\"); "
+      "binmode($$f); my $$data = do { local $$/; <$$f> }; "
+      "my @stamps = ([qr/X{10}_BUILD_USER_X{10}/, $$ENV{LINKSTAMP_USER}], "
+      "[qr/X{8}_BUILD_TIMESTAMP_X{7}/, $$ENV{LINKSTAMP_TIMESTAMP}]); "
+      "for my $$s (@stamps) { while ($$data =~ /$$s->[0]/g) { "
+      "seek($$f, $$-[0], 0); print $$f pack(\"Z32\", $$s->[1]); } } "
+      "close($$f) || die(\"$$ARGV[0]: $$!\\n\")' " + file.path();
+}
 
 void CCBinaryNode::WriteLink(const Resource& file, Makefile* out) const {
   ResourceFileSet objects;
   ObjectFiles(CPP, &objects);
 
-  ResourceFileSet ephemeral_objects, normal_objects;
-  Partition(objects, "ephemeral", &ephemeral_objects, &normal_objects);
-
   set<string> flags;
   LinkFlags(CPP, &flags);
 
+  WriteLink(file, objects, flags, out);
+}
+
+void CCBinaryNode::WriteLink(const Resource& file,
+                             const ResourceFileSet& objects,
+                             const set<string>& flags,
+                             Makefile* out) const {
   // Link rule
   Makefile::Rule* rule =
-    out->StartRule(file.path(), strings::JoinAll(normal_objects.files(), " "));
-
-  string ephemeral_targets = strings::JoinAll(ephemeral_objects.files(), " ");
-  if (!ephemeral_targets.empty()) {
-    rule->WriteUserEcho("Making ephemeral inputs", ephemeral_targets);
-    rule->WriteCommand("make " + ephemeral_targets);
-  }
+    out->StartRule(file.path(), strings::JoinAll(objects.files(), " "));
 
   rule->WriteUserEcho("Linking", file.path());
 
@@ -129,17 +266,34 @@ void CCBinaryNode::WriteLink(const Resource& file, Makefile* out) const {
     }
   }
   rule->WriteCommand("mkdir -p " + file.dirname());
+
+  // Build metadata goes in a linkstamp object, generated as part of the
+  // link and linked last. Programs read it through the generated
+  // "repobuild/linkstamp.h" (see CCLibraryNode::WriteMakeHead). The values
+  // come from the make head (LINKSTAMP_*), and are empty unless
+  // LINKSTAMP=volatile or SOURCE_DATE_EPOCH is set, so by default the same
+  // inputs link to the same binary.
+  Resource linkstamp_src = Resource::FromRootPath(file.path() +
+                                                  ".linkstamp.c");
+  Resource linkstamp_obj = Resource::FromRootPath(file.path() +
+                                                  ".linkstamp.o");
+  rule->WriteCommand(
+      "printf '"
+      "const char repobuild_build_target[] = \"%s\";\\n"
+      "const char repobuild_build_user[] = \"%s\";\\n"
+      "const char repobuild_build_timestamp[] = \"%s\";\\n' "
+      "'" + target().full_path() + "' "
+      "\"$(LINKSTAMP_USER)\" \"$(LINKSTAMP_TIMESTAMP)\" > " +
+      linkstamp_src.path());
+  rule->WriteCommand("$(COMPILE.c) " + linkstamp_src.path() +
+                     " -o " + linkstamp_obj.path());
   rule->WriteCommand(strings::JoinWith(
       " ",
-      "$(LINK.cc)", obj_list, "-o", file,
+      "$(LINK.cc)", obj_list, linkstamp_obj.path(), "-o", file,
       strings::JoinAll(flags, " ")));
-
-  // Some command to inject metadata into the binary
-  // build_* comes from build_timestamp.h
-  rule->WriteCommand(MakeBuildTimestampCommand("id -u -n",
-                     build_user, file));
-  rule->WriteCommand(MakeBuildTimestampCommand("date --rfc-3339=seconds",
-                     build_timestamp, file));
+  if (LinksBuildTimestamp(objects)) {
+    rule->WriteCommand(StampPlaceholdersCommand(file));
+  }
 
   out->FinishRule(rule);
 }
@@ -162,6 +316,13 @@ Resource CCBinaryNode::ObjBinary() const {
   return Resource::FromLocalPath(input().object_dir(), target().make_path());
 }
 
+bool CCBinaryNode::IncludeChildDependency(DependencyCollectionType type,
+                                          LanguageType lang,
+                                          Node* node) const {
+  // pgo_training targets are only built for WritePgo().
+  return pgo_training_.count(node->target().full_path()) == 0;
+}
+
 bool CCBinaryNode::ShouldInclude(DependencyCollectionType type,
                                  LanguageType lang) const {
   return (type != OBJECT_FILES &&
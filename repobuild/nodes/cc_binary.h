@@ -4,6 +4,7 @@
 #ifndef _REPOBUILD_NODES_CC_BINARY_H__
 #define _REPOBUILD_NODES_CC_BINARY_H__
 
+#include <set>
 #include <string>
 #include <vector>
 #include "repobuild/nodes/node.h"
@@ -27,12 +28,30 @@ class CCBinaryNode : public CCLibraryNode {
                                      Makefile::Rule* rule) const;
   virtual bool ShouldInclude(DependencyCollectionType type,
                              LanguageType lang) const;
+  virtual bool IncludeChildDependency(DependencyCollectionType type,
+                                      LanguageType lang,
+                                      Node* node) const;
 
  protected:
   // Helper.
   Resource ObjBinary() const;
+  virtual bool ArchiveObjects() const { return false; }
 
   void WriteLink(const Resource& file, Makefile* out) const;
+  void WriteLink(const Resource& file,
+                 const ResourceFileSet& objects,
+                 const std::set<std::string>& flags,
+                 Makefile* out) const;
+
+  // Profile guided optimization (pgo_training).
+  void InitPgo();
+  void WritePgo(Makefile* out) const;
+  std::string PgoDir() const;
+  const CCBinaryNode* PgoTrainingBinary(const Node* node) const;
+  void PgoLibraries(const CCBinaryNode* binary,
+                    std::vector<const CCLibraryNode*>* libs) const;
+
+  std::set<std::string> pgo_training_;  // full target paths
 };
 
 }  // namespace repobuild
@@ -6,6 +6,7 @@
 #include <string>
 #include <vector>
 #include <iterator>
+#include "common/base/flags.h"
 #include "common/log/log.h"
 #include "common/strings/path.h"
 #include "common/strings/strutil.h"
@@ -14,6 +15,10 @@
 #include "repobuild/nodes/cc_library.h"
 #include "repobuild/reader/buildfile.h"
 
+DEFINE_bool(cc_embed_incbin, true,
+            "If true, cc_embed_data files are assembled into objects with "
+            ".incbin. Otherwise they are compiled as C string literals.");
+
 using std::string;
 using std::vector;
 
@@ -54,6 +59,9 @@ class CCEmbedDataNodeRaw : public Node {
   void GetOutputs(ResourceFileSet* sources,
                   ResourceFileSet* headers) const;
 
+  // "", "zstd" or "lz4".
+  const string& compression() const { return compression_; }
+
  protected:
   string NamespaceStart() const {
     string out = "\"";
@@ -69,6 +77,7 @@ class CCEmbedDataNodeRaw : public Node {
   Resource header_file_, source_file_;
   vector<string> namespaces_;
   vector<Resource> sources_;
+  string compression_;
 };
 
 void CCEmbedDataNodeRaw::ParseWithPath(BuildFile* file,
@@ -77,6 +86,17 @@ void CCEmbedDataNodeRaw::ParseWithPath(BuildFile* file,
   Node::Parse(file, input);
   current_reader()->ParseRepeatedFiles("files", &sources_);
   current_reader()->ParseRepeatedString("namespace", &namespaces_);
+  current_reader()->ParseStringField("compression", &compression_);
+  if (!compression_.empty()) {
+    if (compression_ != "zstd" && compression_ != "lz4") {
+      LOG(FATAL) << "Unknown compression \"" << compression_ << "\" in "
+                 << target().full_path() << ", expected zstd or lz4.";
+    }
+    if (!FLAGS_cc_embed_incbin) {
+      LOG(FATAL) << "Compressed cc_embed_data (" << target().full_path()
+                 << ") needs --cc_embed_incbin.";
+    }
+  }
   header_file_ = Resource::FromLocalPath(Node::input().genfile_dir(),
                                          file_path + ".h");
   source_file_ = Resource::FromLocalPath(Node::input().genfile_dir(),
@@ -95,6 +115,7 @@ void CCEmbedDataNodeRaw::LocalWriteMake(Makefile* out) const {
   //   echo $f;
   // done | .gen-files/cc_embed.sh
   //           out_header out_cpp out_if_guard "namespace_start" "namespace_end"
+  //           compression
   vector<string> inputs;
   for (const Resource& source : sources_) {
     inputs.push_back("\"" +
@@ -116,7 +137,8 @@ void CCEmbedDataNodeRaw::LocalWriteMake(Makefile* out) const {
                              RemoveNonAlpha(StripSpecialDirs(
                                  header_file_.path()))),
                          NamespaceStart(),
-                         NamespaceEnd()));
+                         NamespaceEnd(),
+                         compression_));
   out->FinishRule(rule);
 
   // cc file depends on header file. Originally this was part of StartRule
@@ -158,6 +180,11 @@ void CCEmbedDataNode::Parse(BuildFile* file, const BuildFileNode& input) {
 
   // Fill out cc_library
   cc_library->AddDependencyTarget(embed_node->target());
+  if (!embed_node->compression().empty()) {
+    cc_library->PreInitLinkerArgs(
+        vector<string>(1, embed_node->compression() == "zstd" ?
+                       "-lzstd" : "-llz4"));
+  }
   ResourceFileSet sources, headers;
   embed_node->GetOutputs(&sources, &headers);
   cc_library->PreInitSources(sources, headers);
@@ -166,20 +193,24 @@ void CCEmbedDataNode::Parse(BuildFile* file, const BuildFileNode& input) {
 
 // static
 void CCEmbedDataNode::WriteMakeHead(const Input& input, Makefile* out) {
-  const char kShellScript[] =
+  // cc_embed.sh <header> <cpp> <guard> <namespace start> <namespace end>
+  //             [compression], reading "<file> <variable>" lines from stdin.
+  const char kScriptStart[] =
       "#!/bin/bash\n"
       "HEADER=\"$1\"\n"
       "CPP=\"$2\"\n"
       "GUARD=\"$3\"\n"
       "NAMESPACE_START=\"$4\"\n"
       "NAMESPACE_END=\"$5\"\n"
+      "COMPRESSION=\"$6\"\n"
       // Header - start
       "echo \"#ifndef $GUARD\" > $HEADER\n"
       "echo \"#define $GUARD\" >> $HEADER\n"
       "echo \"#include <cstring>  // size_t\" >> $HEADER\n"
       "echo \"$NAMESPACE_START\" >> $HEADER\n"
       // Cpp - start
-      "echo \"#include \\\"$(basename $HEADER)\\\"\" > $CPP\n"
+      "echo \"#include \\\"$(basename $HEADER)\\\"\" > $CPP\n";
+  const char kScriptVariableStart[] =
       "echo \"$NAMESPACE_START\" >> $CPP\n"
 
       // Per-variable
@@ -188,7 +219,29 @@ void CCEmbedDataNode::WriteMakeHead(const Input& input, Makefile* out) {
       "  echo \"// Auto generated from $SOURCE\" >> $HEADER\n"
       "  echo \"extern const char* \"$VARIABLE\"_data();\" >> $HEADER\n"
       "  echo \"extern size_t \"$VARIABLE\"_size();\" >> $HEADER\n"
-      "  echo \"\" >> $HEADER\n"
+      "  if [ -n \"$COMPRESSION\" ]; then\n"
+      "    echo \"// The $COMPRESSION compressed data we embed. _data() "
+      "decompresses\" >> $HEADER\n"
+      "    echo \"// it on first use, into a buffer kept for the life of the "
+      "process.\" >> $HEADER\n"
+      "    echo \"extern const char* \"$VARIABLE\"_compressed_data();\" "
+      ">> $HEADER\n"
+      "    echo \"extern size_t \"$VARIABLE\"_compressed_size();\" "
+      ">> $HEADER\n"
+      "  fi\n"
+      "  echo \"\" >> $HEADER\n";
+  const char kScriptEnd[] =
+      "done\n"
+
+      // Header - end
+      "echo \"$NAMESPACE_END\" >> $HEADER\n"
+      "echo \"#endif  // $GUARD\" >> $HEADER\n"
+
+      // Cpp - end
+      "echo \"$NAMESPACE_END\" >> $CPP\n";
+
+  // Data as a C string literal, which the compiler has to parse.
+  const char kLiteralVariable[] =
       //   Cpp
       "  echo \"const char* \"$VARIABLE\"_data() {\" >> $CPP\n"
       "  printf \"  return \\\"\" >> $CPP\n"
@@ -202,18 +255,137 @@ void CCEmbedDataNode::WriteMakeHead(const Input& input, Makefile* out) {
       "  printf \"  return \" >> $CPP\n"
       "  printf $(cat $SOURCE | wc -c) >> $CPP\n"
       "  echo \";\" >> $CPP\n"
-      "  echo \"}\" >> $CPP\n"
-      "done\n"
+      "  echo \"}\" >> $CPP\n";
 
-      // Header - end
-      "echo \"$NAMESPACE_END\" >> $HEADER\n"
-      "echo \"#endif  // $GUARD\" >> $HEADER\n"
+  // Data pulled in by the assembler, with the same _data()/_size() API.
+  const char kIncbinPrelude[] =
+      "cat >> $CPP <<'EOF'\n"
+      "// The data is assembled straight into our object (.incbin) and NUL\n"
+      "// terminated, like the string literal it replaces.\n"
+      "#if defined(__APPLE__)\n"
+      "#define REPOBUILD_EMBED_SECTION \".const\\n\"\n"
+      "#define REPOBUILD_EMBED_SECTION_END \".text\\n\"\n"
+      "#define REPOBUILD_EMBED_SYMBOL(name) \\\n"
+      "    \".private_extern _\" #name \"\\n_\" #name \":\\n\"\n"
+      "#else\n"
+      "#define REPOBUILD_EMBED_SECTION \".pushsection .rodata\\n\"\n"
+      "#define REPOBUILD_EMBED_SECTION_END \".popsection\\n\"\n"
+      "#define REPOBUILD_EMBED_SYMBOL(name) \\\n"
+      "    \".globl \" #name \"\\n.hidden \" #name \"\\n\" #name \":\\n\"\n"
+      "#endif\n"
+      "EOF\n";
 
-      // Cpp - end
-      "echo \"$NAMESPACE_END\" >> $CPP\n";
+  // RepobuildEmbedDecompress(data, size, raw_size) for compressed data,
+  // returning a NUL terminated malloc()ed buffer of raw_size bytes.
+  const char kDecompressPrelude[] =
+      "if [ \"$COMPRESSION\" = zstd ]; then\n"
+      "cat >> $CPP <<'EOF'\n"
+      "#include <cstdlib>\n"
+      "#include <zstd.h>\n"
+      "namespace {\n"
+      "const char* RepobuildEmbedDecompress(const char* data, size_t size,\n"
+      "                                     size_t raw_size) {\n"
+      "  char* raw = static_cast<char*>(malloc(raw_size + 1));\n"
+      "  if (raw == NULL) {\n"
+      "    abort();\n"
+      "  }\n"
+      "  size_t result = ZSTD_decompress(raw, raw_size, data, size);\n"
+      "  if (ZSTD_isError(result) || result != raw_size) {\n"
+      "    abort();\n"
+      "  }\n"
+      "  raw[raw_size] = 0;\n"
+      "  return raw;\n"
+      "}\n"
+      "}  // anonymous namespace\n"
+      "EOF\n"
+      "elif [ \"$COMPRESSION\" = lz4 ]; then\n"
+      "cat >> $CPP <<'EOF'\n"
+      "#include <cstdlib>\n"
+      "#include <lz4frame.h>\n"
+      "namespace {\n"
+      "const char* RepobuildEmbedDecompress(const char* data, size_t size,\n"
+      "                                     size_t raw_size) {\n"
+      "  char* raw = static_cast<char*>(malloc(raw_size + 1));\n"
+      "  LZ4F_dctx* context = NULL;\n"
+      "  if (raw == NULL || LZ4F_isError(LZ4F_createDecompressionContext(\n"
+      "          &context, LZ4F_VERSION))) {\n"
+      "    abort();\n"
+      "  }\n"
+      "  size_t in = 0, out = 0, hint = 1;\n"
+      "  while (hint != 0) {\n"
+      "    size_t in_size = size - in, out_size = raw_size - out;\n"
+      "    hint = LZ4F_decompress(context, raw + out, &out_size,\n"
+      "                           data + in, &in_size, NULL);\n"
+      "    in += in_size;\n"
+      "    out += out_size;\n"
+      "    if (LZ4F_isError(hint) || (in_size == 0 && out_size == 0)) {\n"
+      "      abort();\n"
+      "    }\n"
+      "  }\n"
+      "  LZ4F_freeDecompressionContext(context);\n"
+      "  if (out != raw_size) {\n"
+      "    abort();\n"
+      "  }\n"
+      "  raw[raw_size] = 0;\n"
+      "  return raw;\n"
+      "}\n"
+      "}  // anonymous namespace\n"
+      "EOF\n"
+      "fi\n";
+  // With compression we embed the compressed copy under
+  // <variable>_compressed_data()/_size().
+  const char kIncbinVariable[] =
+      "  SYMBOL=\"${GUARD}_${VARIABLE}\"\n"
+      "  DATA=\"$SOURCE\"\n"
+      "  ACCESSOR=\"$VARIABLE\"\n"
+      "  if [ -n \"$COMPRESSION\" ]; then\n"
+      "    DATA=\"${CPP%.cc}_$VARIABLE.$COMPRESSION\"\n"
+      "    ACCESSOR=\"${VARIABLE}_compressed\"\n"
+      "    case \"$COMPRESSION\" in\n"
+      "      zstd) zstd -q -f -19 \"$SOURCE\" -o \"$DATA\" ;;\n"
+      "      lz4) lz4 -q -f -9 \"$SOURCE\" \"$DATA\" ;;\n"
+      "    esac || exit 1\n"
+      "  fi\n"
+      "  cat >> $CPP <<EOF\n"
+      "// Auto generated from $SOURCE\n"
+      "__asm__(REPOBUILD_EMBED_SECTION\n"
+      "        \".balign 16\\n\"\n"
+      "        REPOBUILD_EMBED_SYMBOL(${SYMBOL}_begin)\n"
+      "        \".incbin \\\"$DATA\\\"\\n\"\n"
+      "        REPOBUILD_EMBED_SYMBOL(${SYMBOL}_end)\n"
+      "        \".byte 0\\n\"\n"
+      "        REPOBUILD_EMBED_SECTION_END);\n"
+      "extern \"C\" const char ${SYMBOL}_begin[], ${SYMBOL}_end[];\n"
+      "const char* ${ACCESSOR}_data() { return ${SYMBOL}_begin; }\n"
+      "size_t ${ACCESSOR}_size() {\n"
+      "  return ${SYMBOL}_end - ${SYMBOL}_begin;\n"
+      "}\n"
+      "\n"
+      "EOF\n"
+      "  if [ -n \"$COMPRESSION\" ]; then\n"
+      "    RAW_SIZE=$(wc -c < \"$SOURCE\" | tr -d ' ')\n"
+      "    cat >> $CPP <<EOF\n"
+      "const char* ${VARIABLE}_data() {\n"
+      "  static const char* data = RepobuildEmbedDecompress(\n"
+      "      ${ACCESSOR}_data(), ${ACCESSOR}_size(), $RAW_SIZE);\n"
+      "  return data;\n"
+      "}\n"
+      "size_t ${VARIABLE}_size() { return $RAW_SIZE; }\n"
+      "\n"
+      "EOF\n"
+      "  fi\n";
+
+  string script = kScriptStart;
+  if (FLAGS_cc_embed_incbin) {
+    script += string(kIncbinPrelude) + kDecompressPrelude +
+        kScriptVariableStart + kIncbinVariable;
+  } else {
+    script += string(kScriptVariableStart) + kLiteralVariable;
+  }
+  script += kScriptEnd;
   out->GenerateExecFile("CCEmbed",
                         EmbedScript(input),
-                        kShellScript);
+                        script);
 }
 
 }  // namespace repobuild
@@ -1,18 +1,53 @@
 // Copyright 2013
 // Author: Christopher Van Arsdale
 
+#include <algorithm>
+#include <cctype>
+#include <cstdint>
 #include <string>
 #include <set>
 #include <iterator>
 #include <vector>
+#include "common/base/flags.h"
 #include "common/log/log.h"
 #include "common/strings/path.h"
 #include "common/strings/strutil.h"
 #include "repobuild/env/input.h"
 #include "repobuild/nodes/cc_library.h"
+#include "repobuild/nodes/cc_worker_pl.h"
 #include "repobuild/nodes/util.h"
 #include "repobuild/reader/buildfile.h"
 
+DEFINE_bool(cc_header_depfiles, true,
+            "If true, C/C++ objects depend on the headers the compiler "
+            "reports (-MMD), rather than on every header of every dependency.");
+DEFINE_int32(cc_unity_batch_size, 0,
+             "If > 1, c++ sources of each cc_library are compiled in unity "
+             "translation units of about this many sources. Overridden by "
+             "the unity_batch_size attribute.");
+DEFINE_string(cc_link_archives, "none",
+              "How cc_library objects are linked into binaries: \"none\" "
+              "links the objects directly, \"thin\" or regular \"static\" "
+              "archives link only the objects a binary needs. Libraries "
+              "that rely on static registration must then be alwayslink.");
+DEFINE_bool(cc_fast_link, false,
+            "Default for the CC_FAST_LINK make variable. If set, links use "
+            "mold, lld or gold when the compiler can find one, with split "
+            "DWARF, a gdb index and compressed debug sections.");
+DEFINE_bool(cc_time_trace, false,
+            "Default for the CC_TIME_TRACE make variable. If set, each "
+            "object gets a <object>.time-trace (clang -ftime-trace or gcc "
+            "-ftime-report) for \"repobuild report compile-time\".");
+DEFINE_string(cc_workers, "",
+              "Default for the CC_WORKERS make variable: host:port,... of "
+              "\"cc_worker.pl serve\" workers to run c/c++ compiles on.");
+DEFINE_string(cc_linkstamp, "stable",
+              "Default for the LINKSTAMP make variable. \"stable\" leaves the "
+              "build user and time out of binaries (the time comes from "
+              "SOURCE_DATE_EPOCH, if set); \"volatile\" stamps them at link "
+              "time.");
+
+using std::map;
 using std::vector;
 using std::string;
 using std::set;
@@ -25,8 +60,91 @@ const char kCCompileArgs[] = "c_compile_args";
 const char kCxxCompileArgs[] = "cxx_compile_args";
 const char kCHeaderArgs[] = "c_header_compile_args";
 const char kCxxHeaderArgs[] = "cxx_header_compile_args";
+const char kPrecompiledHeader[] = "precompiled_header";
+const char kCompileInputs[] = "cc_compile_inputs";
+const char kCCompileFlags[] = "c_compile_flags";
+const char kCxxCompileFlags[] = "cxx_compile_flags";
 const char kCGcc[] = "CC_GCC";
 const char kCxxGcc[] = "CXX_GCC";
+
+// cc_module_scan.pl <object> <module cache> <gcm|pcm> [<header unit>...]
+// Reads the preprocessed source of <object>, and prints make rules for the
+// modules it imports (in <module cache>, named as gcc's mapper and clang's
+// -fprebuilt-module-path name them) and those it provides. For clang (pcm)
+// it also sets the -fmodule-file args of <object>, and the module file an
+// interface precompiles to.
+const char kModuleScanScript[] =
+    "#!/usr/bin/perl\n"
+    "use warnings;\n"
+    "use strict;\n"
+    "my ($obj, $cache, $ext, @header_units) = @ARGV;\n"
+    "my ($module, %requires, %provides, $imports_headers);\n"
+    "while (<STDIN>) {\n"
+    "    if (/^\\s*(export\\s+)?module\\s+([\\w.]+)(:[\\w.]+)?\\s*;/)"
+    " {\n"
+    "        $module = $2;\n"
+    "        if ($1 || $3) {\n"
+    "            $provides{$2 . ($3 || \"\")} = 1;\n"
+    "        } else {\n"
+    "            $requires{$2} = 1;\n"
+    "        }\n"
+    "    } elsif "
+    "(/^\\s*(export\\s+)?import\\s+(:?[\\w.]+(:[\\w.]+)?)\\s*;/) {\n"
+    "        my $name = $2;\n"
+    "        $name = $module . $name if $name =~ /^:/ && defined($module);\n"
+    "        $requires{$name} = 1;\n"
+    "    } elsif (/^\\s*(export\\s+)?import\\s*[<\"]/) {\n"
+    "        $imports_headers = 1;\n"
+    "    }\n"
+    "}\n"
+    "delete $requires{$_} for keys %provides;\n"
+    "sub Cmi { (my $name = shift) =~ s/:/-/; return \"$cache/$name.$ext\"; }\n"
+    "my @prereqs = map { Cmi($_) } sort keys %requires;\n"
+    "push(@prereqs, @header_units) if $imports_headers;\n"
+    "print \"$obj: @prereqs\\nCXX_MODULES_$obj := 1\\n\" if @prereqs;\n"
+    "print Cmi($_) . \": $obj\\n\\t\\@touch \\$@\\n\"\n"
+    "    for sort keys %provides;\n"
+    "if ($ext eq \"pcm\") {\n"
+    "    my @files = map { \"-fmodule-file=$_=\" . Cmi($_) } sort keys %requires;\n"
+    "    push(@files, map { \"-fmodule-file=$_\" } @header_units)\n"
+    "        if $imports_headers;\n"
+    "    print \"CXX_MODULE_FILES_$obj := @files\\n\" if @files;\n"
+    "    print \"CXX_MODULE_OUTPUT_$obj := \" . Cmi($_) . \"\\n\"\n"
+    "        for sort keys %provides;\n"
+    "}\n";
+
+// "foo::bar::Sum" => [ "foo", "bar", "Sum" ].
+vector<string> SplitQualifiedName(const string& name) {
+  vector<string> parts;
+  size_t start = 0, end;
+  while ((end = name.find("::", start)) != string::npos) {
+    parts.push_back(name.substr(start, end - start));
+    start = end + 2;
+  }
+  parts.push_back(name.substr(start));
+  return parts;
+}
+
+// "sse4.2" => "sse4_2".
+string CpuVariantName(const string& variant) {
+  string name = variant;
+  std::replace(name.begin(), name.end(), '.', '_');
+  return name;
+}
+
+bool IsCppSource(const Resource& source) {
+  return (strings::HasSuffix(source.basename(), ".cc") ||
+          strings::HasSuffix(source.basename(), ".cpp"));
+}
+
+// FNV-1a, so unity batches do not depend on the std::hash implementation.
+uint32_t StableHash(const string& str) {
+  uint32_t hash = 2166136261u;
+  for (char c : str) {
+    hash = (hash ^ static_cast<unsigned char>(c)) * 16777619u;
+  }
+  return hash;
+}
 }
 
 void CCLibraryNode::Parse(BuildFile* file, const BuildFileNode& input) {
@@ -41,6 +159,11 @@ void CCLibraryNode::Parse(BuildFile* file, const BuildFileNode& input) {
   // cc_objs
   current_reader()->ParseRepeatedFiles("cc_objects", &objects_);
 
+  // cc_module_interfaces, cc_header_units (C++20 modules)
+  current_reader()->ParseRepeatedFiles("cc_module_interfaces",
+                                       &module_interfaces_);
+  current_reader()->ParseRepeatedFiles("cc_header_units", &header_units_);
+
   // ephemeral cc sources
   std::vector<Resource> ephemeral_cc_sources;
   current_reader()->ParseRepeatedFiles("ephemeral_cc_sources",
@@ -50,6 +173,31 @@ void CCLibraryNode::Parse(BuildFile* file, const BuildFileNode& input) {
     sources_.push_back(it);
   }
 
+  // precompiled_header
+  vector<Resource> tmp_pch;
+  current_reader()->ParseSingleFile("precompiled_header", &tmp_pch);
+  if (tmp_pch.size() > 1) {
+    LOG(FATAL) << "precompiled_header must match exactly 1 file in "
+               << target().full_path()
+               << ". Found " << tmp_pch.size() << " files.";
+  } else if (tmp_pch.size() == 1) {
+    precompiled_header_ = tmp_pch[0];
+  }
+
+  // unity_batch_size, unity_excluded_sources
+  unity_batch_size_ = FLAGS_cc_unity_batch_size;
+  current_reader()->ParseIntField("unity_batch_size", &unity_batch_size_);
+  vector<Resource> unity_excluded;
+  current_reader()->ParseRepeatedFiles("unity_excluded_sources",
+                                       &unity_excluded);
+  set<Resource> unity_excluded_set(unity_excluded.begin(),
+                                   unity_excluded.end());
+  for (Resource& r : sources_) {
+    if (unity_excluded_set.find(r) != unity_excluded_set.end()) {
+      r.add_tag("nounity");
+    }
+  }
+
   // alwayslink
   bool alwayslink = false;
   if (current_reader()->ParseBoolField("alwayslink", &alwayslink) &&
@@ -71,29 +219,42 @@ void CCLibraryNode::Parse(BuildFile* file, const BuildFileNode& input) {
     cc_include_dirs_.push_back(r.path());
   }
 
-  // cc_compile_args, header_compile_args, cc_linker_args
-  current_reader()->ParseRepeatedString("cc_compile_args",
-                                        &cc_compile_args_);
-  current_reader()->ParseRepeatedString("header_compile_args",
-                                        &header_compile_args_);
-  current_reader()->ParseRepeatedString("cc_linker_args",
-                                        &cc_linker_args_);
+  // cc_compile_args, header_compile_args, cc_linker_args (makefile text).
+  current_reader()->ParseRepeatedMakeString("cc_compile_args", false,
+                                            &cc_compile_args_);
+  current_reader()->ParseRepeatedMakeString("header_compile_args", false,
+                                            &header_compile_args_);
+  current_reader()->ParseRepeatedMakeString("cc_linker_args", false,
+                                            &cc_linker_args_);
 
   // gcc
-  current_reader()->ParseRepeatedString("gcc.cc_compile_args",
-                                        &gcc_cc_compile_args_);
-  current_reader()->ParseRepeatedString("gcc.header_compile_args",
-                                        &gcc_header_compile_args_);
-  current_reader()->ParseRepeatedString("gcc.cc_linker_args",
-                                        &gcc_cc_linker_args_);
+  current_reader()->ParseRepeatedMakeString("gcc.cc_compile_args", false,
+                                            &gcc_cc_compile_args_);
+  current_reader()->ParseRepeatedMakeString("gcc.header_compile_args",
+                                            false,
+                                            &gcc_header_compile_args_);
+  current_reader()->ParseRepeatedMakeString("gcc.cc_linker_args", false,
+                                            &gcc_cc_linker_args_);
 
   // clang
-  current_reader()->ParseRepeatedString("clang.cc_compile_args",
-                                        &clang_cc_compile_args_);
-  current_reader()->ParseRepeatedString("clang.header_compile_args",
-                                        &clang_header_compile_args_);
-  current_reader()->ParseRepeatedString("clang.cc_linker_args",
-                                        &clang_cc_linker_args_);
+  current_reader()->ParseRepeatedMakeString("clang.cc_compile_args", false,
+                                            &clang_cc_compile_args_);
+  current_reader()->ParseRepeatedMakeString("clang.header_compile_args",
+                                            false,
+                                            &clang_header_compile_args_);
+  current_reader()->ParseRepeatedMakeString("clang.cc_linker_args", false,
+                                            &clang_cc_linker_args_);
+
+  // cpu_variants, cpu_variant_sources, cpu_variant_functions
+  current_reader()->ParseRepeatedString("cpu_variants", &cpu_variants_);
+  current_reader()->ParseRepeatedFiles("cpu_variant_sources",
+                                       &cpu_variant_sources_);
+  current_reader()->ParseRepeatedString("cpu_variant_functions",
+                                        &cpu_variant_functions_);
+  if (!cpu_variants_.empty() || !cpu_variant_sources_.empty() ||
+      !cpu_variant_functions_.empty()) {
+    InitCpuVariants();
+  }
 
   Init();
 }
@@ -121,6 +282,10 @@ void CCLibraryNode::PreInitSources(const ResourceFileSet& sources,
   }
 }
 
+void CCLibraryNode::PreInitLinkerArgs(const vector<string>& args) {
+  cc_linker_args_.insert(cc_linker_args_.end(), args.begin(), args.end());
+}
+
 void CCLibraryNode::Init() {
   if (!headers_.empty()) {
     MutableVariable(kHeaderVariable)->SetValue(strings::JoinAll(headers_, " "));
@@ -158,128 +323,777 @@ void CCLibraryNode::Init() {
                   " ",
                   strings::JoinAll(cc_linker_args_, " "),
                   strings::JoinAll(gcc_cc_linker_args_, " ")));
+
+  // precompiled_header, gcc and clang name the output differently.
+  if (!precompiled_header_.path().empty()) {
+    AddConditionalMakeVariable(kPrecompiledHeader, kCxxGcc,
+                               PrecompiledHeaderStub().path() + ".gch",
+                               PrecompiledHeaderStub().path() + ".pch");
+  }
+
+  InitUnitySources();
+}
+
+void CCLibraryNode::InitUnitySources() {
+  compile_sources_.clear();
+  unity_members_.clear();
+
+  vector<Resource> batched;
+  for (const Resource& source : sources_) {
+    if (unity_batch_size_ > 1 && IsCppSource(source) &&
+        !source.has_tag("ephemeral") && !source.has_tag("nounity")) {
+      batched.push_back(source);
+    } else {
+      compile_sources_.push_back(source);
+    }
+  }
+  if (batched.size() < 2) {
+    compile_sources_ = sources_;
+    return;
+  }
+
+  // Each source is assigned to a batch by a hash of its path, and the number
+  // of batches only changes when it doubles, so adding or removing a source
+  // normally changes only the batch that source is in.
+  size_t num_batches = 1;
+  while (num_batches * unity_batch_size_ < batched.size()) {
+    num_batches *= 2;
+  }
+  vector<vector<Resource> > batches(num_batches);
+  std::sort(batched.begin(), batched.end());
+  for (const Resource& source : batched) {
+    batches[StableHash(source.path()) % num_batches].push_back(source);
+  }
+
+  for (const vector<Resource>& batch : batches) {
+    if (batch.size() == 1) {
+      compile_sources_.push_back(batch[0]);
+    } else if (batch.size() > 1) {
+      // Name the unit after its members, so a membership change produces a
+      // new file instead of needing to rewrite an existing one.
+      string unity_name = strings::StringPrintf(
+          "%s.unity_%08x.cc",
+          target().local_path().c_str(),
+          StableHash(strings::JoinAll(batch, " ")));
+      Resource unity_source = Resource::FromLocalPath(GenDir(), unity_name);
+      unity_source.CopyTags(batch[0]);
+      compile_sources_.push_back(unity_source);
+      unity_members_[unity_source.path()] = batch;
+    }
+  }
 }
 
 void CCLibraryNode::LocalWriteMake(Makefile* out) const {
   LocalWriteMakeInternal(true, out);
 }
 
-void CCLibraryNode::LocalWriteMakeInternal(bool should_write_target,
-                                           Makefile* out) const {
-  // Figure out the set of input files.
+void CCLibraryNode::LocalWriteMakeVariables(Makefile* out) const {
+  // Input files and compile flags, shared by all of our compile rules and
+  // by the variant compiles other nodes write for us (WriteVariantCompiles).
   ResourceFileSet input_files;
   InputDependencyFiles(CPP, &input_files);  // any object files/headers/etc.
   CCLibraryNode::LocalDependencyFiles(CPP, &input_files);  // our headers
+  WriteCompileVariables(input_files, out);
+}
+
+void CCLibraryNode::LocalWriteMakeInternal(bool should_write_target,
+                                           Makefile* out) const {
+  // Precompiled header, shared by all of our c++ sources.
+  if (!precompiled_header_.path().empty()) {
+    WritePrecompiledHeader(out);
+  }
+
+  // Module interfaces and header units, which our sources import.
+  WriteModules(out);
+
+  // Per-cpu builds of cpu_variant_sources, and their dispatch source.
+  if (!cpu_variant_sources_.empty()) {
+    WriteCpuVariants(out);
+  }
 
-  // Now write phases, one per .cc
-  for (int i = 0; i < sources_.size(); ++i) {
-    // Output object.
-    WriteCompile(sources_[i], input_files, out);
+  // Now write phases, one per .cc (or unity translation unit).
+  for (const Resource& source : compile_sources_) {
+    auto unity = unity_members_.find(source.path());
+    if (unity == unity_members_.end()) {
+      WriteCompile(source, ObjForSource(source), "", "", ResourceFileSet(),
+                   out);
+    } else {
+      WriteUnitySource(source, unity->second, out);
+      ResourceFileSet unity_members;
+      unity_members.AddRange(unity->second);
+      WriteCompile(source, ObjForSource(source), "", "", unity_members, out);
+    }
+  }
+
+  // Archive for dependents to link.
+  if (ArchiveObjects()) {
+    WriteArchive(out);
   }
 
   // Now write user target (so users can type "make path/to/exec|lib").
   if (should_write_target) {
     ResourceFileSet targets;
-    for (const Resource& source : sources_) {
+    for (const Resource& source : compile_sources_) {
       targets.Add(ObjForSource(source));
     }
+    targets.AddRange(ModuleTargets().files());
+    CpuVariantObjectFiles(&targets);
+    if (ArchiveObjects()) {
+      targets.Add(ObjArchive());
+    }
     WriteBaseUserTarget(targets, out);
   }
 }
 
+void CCLibraryNode::WriteVariantCompiles(const string& variant_dir,
+                                         const string& variant_args,
+                                         const string& variant_prereqs,
+                                         Makefile* out) const {
+  for (const Resource& source : compile_sources_) {
+    ResourceFileSet unity_members;
+    auto unity = unity_members_.find(source.path());
+    if (unity != unity_members_.end()) {
+      unity_members.AddRange(unity->second);
+    }
+    WriteCompile(source, VariantObj(variant_dir, source),
+                 variant_args, variant_prereqs, unity_members, out);
+  }
+}
+
+void CCLibraryNode::VariantObjectFiles(const string& variant_dir,
+                                       ResourceFileSet* files) const {
+  for (const Resource& source : compile_sources_) {
+    files->Add(VariantObj(variant_dir, source));
+  }
+  for (const Resource& source : module_interfaces_) {
+    files->Add(ObjForSource(source));  // not rebuilt for variants.
+  }
+  CpuVariantObjectFiles(files);  // likewise.
+  for (const Resource& obj : objects_) {
+    files->Add(obj);
+  }
+}
+
+Resource CCLibraryNode::VariantObj(const string& variant_dir,
+                                   const Resource& source) const {
+  return Resource::FromLocalPath(variant_dir,
+                                 StripSpecialDirs(source.path()) + ".o");
+}
+
 void CCLibraryNode::WriteCompile(const Resource& source,
-                                 const ResourceFileSet& input_files,
+                                 const Resource& obj,
+                                 const string& variant_args,
+                                 const string& variant_prereqs,
+                                 const ResourceFileSet& extra_input_files,
                                  Makefile* out) const {
-  Resource obj = ObjForSource(source);
+  // Ephemeral sources are compiled once per make run (they depend on
+  // $(EPHEMERAL_STAMP)), into a temporary file that is renamed into place,
+  // so an interrupted compile never leaves a stale object behind.
   bool ephemeral_output = source.has_tag("ephemeral");
-  string ephemeral_dot_o;
+  string ephemeral_dot_o = obj.path() + ".tmp";
 
-  if (ephemeral_output) {
-    // When a user runs a parallel make ("make -j8"), two cc_binaries
-    // that depend on the same cc_library containing ephemeral sources
-    // may each call make recursively to compile the same source file.
-    // To avoid corruption by simultaneous compilation to the same .o
-    // file, we use distinct temporary file names, then "mv" the .o
-    // file to the correct place atomically.  It remains a race as to
-    // which instance of the .o gets used: it could be either or both.
-    ephemeral_dot_o = "ephemeral" + obj.path();
-    out->append("\n" + ephemeral_dot_o +
-		" := $(shell mkdir -p " + obj.dirname() + "; "
-		"mktemp --tmpdir=" + obj.dirname() + ")\n");
-    ephemeral_dot_o = "$(" + ephemeral_dot_o + ")";
-  }
+  // Compile command (.e.g $(COMPILE.c) or $(COMPILE.cc)), run through
+  // cc_worker.pl when CC_WORKERS is set.
+  bool cpp = IsCppSource(source);
+  string compile = "$(CC_LAUNCHER) " + DefaultCompileFlags(cpp);
+  // The PCH is built with the default args, so variants skip it.
+  bool pch = (cpp && !precompiled_header_.path().empty() &&
+              variant_args.empty());
 
   // Rule=> obj: <input header files> source.cc
-  Makefile::Rule* rule =
-      out->StartRule(obj.path(),
-                     strings::JoinWith(
-                         " ",
-                         strings::JoinAll(input_files.files(), " "),
-                         source.path()));
+  //   or, with compiler generated dependencies:
+  //     obj: source.cc | <input header files>
+  //     -include obj.d
+  bool depfile = FLAGS_cc_header_depfiles && !ephemeral_output;
+  string pch_file = (pch ? GetVariable(kPrecompiledHeader).ref_name() : "");
+
+  // With modules around, the scan of our source orders us after the
+  // modules it imports, and sets $(CXX_MODULES_<obj>) if there are any.
+  bool scan_modules = cpp && ScanModules();
+  if (scan_modules) {
+    WriteModuleScan(source, obj, variant_args, out);
+  }
+  string input_files = strings::JoinWith(
+      " ",
+      CompileVariableRef(kCompileInputs),
+      strings::JoinAll(extra_input_files.files(), " "));
+  Makefile::Rule* rule;
+  if (depfile) {
+    rule = out->StartRule(obj.path(),
+                          strings::JoinWith(
+                              " ",
+                              source.path(),
+                              pch_file,
+                              variant_prereqs,
+                              "|",
+                              input_files,
+                              "$(CC_WORKER_SCRIPT)"));
+  } else {
+    rule = out->StartRule(obj.path(),
+                          strings::JoinWith(
+                              " ",
+                              input_files,
+                              "$(CC_WORKER_SCRIPT)",
+                              pch_file,
+                              variant_prereqs,
+                              (ephemeral_output ? "$(EPHEMERAL_STAMP)" : ""),
+                              source.path()));
+  }
 
   // Mkdir command.
   rule->WriteCommand("mkdir -p " + obj.dirname());
 
-  // Compile command (.e.g $(COMPILE.c) or $(COMPILE.cc)).
-  bool cpp = (strings::HasSuffix(source.basename(), ".cc") ||
-              strings::HasSuffix(source.basename(), ".cpp"));
-  string compile = DefaultCompileFlags(cpp);
+  // Actual make command.
+  rule->WriteUserEcho("Compiling",
+                      source.path() + " (" + (cpp ? "c++" : "c") + ")");
+  rule->WriteCommand(strings::JoinWith(
+      " ",
+      compile,
+      CompileVariableRef(cpp ? kCxxCompileFlags : kCCompileFlags),
+      variant_args,
+      (scan_modules ? "$(if $(CXX_MODULES_$@),$(CXX_MODULE_ARGS))" : ""),
+      (depfile ? "-MMD -MP -MF " + DepfileForObj(obj).path() : ""),
+      (pch ? "-include " + PrecompiledHeaderStub().path() : ""),
+      source.path(),
+      "-o " + (ephemeral_output ? ephemeral_dot_o : obj.path()),
+      (ephemeral_output ? "" :
+       (cpp ? "$(CXX_TIME_TRACE)" : "$(C_TIME_TRACE)"))));
+
+  if (depfile && scan_modules) {
+    StripModuleDepfile(DepfileForObj(obj), rule);
+  }
+
+  if (ephemeral_output) {
+    rule->WriteCommand("mv -f " + ephemeral_dot_o + " " + obj.path());
+  }
+
+  out->FinishRule(rule);
+
+  if (depfile) {
+    out->append("-include " + DepfileForObj(obj).path() + "\n");
+  }
+}
+
+void CCLibraryNode::WriteCompileVariables(const ResourceFileSet& input_files,
+                                          Makefile* out) const {
+  // Computed once here rather than once per source, which for a large
+  // library was most of its Makefile (and of make's parse time). Recursive
+  // (=), so the headers.* of other nodes they name are looked up when a
+  // rule uses them, not when they are defined.
+  bool cpp = !precompiled_header_.path().empty(), c = false;
+  for (const Resource& source : compile_sources_) {
+    (IsCppSource(source) ? cpp : c) = true;
+  }
+  for (const Resource& source : cpu_variant_sources_) {
+    (IsCppSource(source) ? cpp : c) = true;
+  }
+  if (!cpp && !c) {
+    return;
+  }
+  out->append(CompileVariable(kCompileInputs) + " = " +
+              strings::JoinAll(input_files.files(), " ") + "\n");
+  if (cpp) {
+    out->append(CompileVariable(kCxxCompileFlags) + " = " +
+                strings::JoinWith(" ",
+                                  IncludeDirFlags(true),
+                                  CompileArgFlags(true)) + "\n");
+  }
+  if (c) {
+    out->append(CompileVariable(kCCompileFlags) + " = " +
+                strings::JoinWith(" ",
+                                  IncludeDirFlags(false),
+                                  CompileArgFlags(false)) + "\n");
+  }
+  out->append("\n");
+}
+
+string CCLibraryNode::CompileVariable(const string& name) const {
+  return name + "." + target().make_path();
+}
+
+string CCLibraryNode::CompileVariableRef(const string& name) const {
+  return "$(" + CompileVariable(name) + ")";
+}
 
-  // Include directories.
+string CCLibraryNode::IncludeDirFlags(bool cpp_mode) const {
+  set<string> include_dir_set, final_includes;
+  IncludeDirs(cpp_mode ? CPP : C_LANG, &include_dir_set);
+  for (const string& str: include_dir_set) {
+    final_includes.insert(str);
+    string path = NodeUtil::StripSpecialDirs(input(), str);
+    if (!path.empty()){
+      final_includes.insert(path);
+    }
+    final_includes.insert(Resource::FromLocalPath(
+        input().genfile_dir(), path).path());
+    final_includes.insert(Resource::FromLocalPath(
+        input().source_dir(), path).path());
+  }
   string include_dirs;
-  {
-    set<string> include_dir_set, final_includes;
-    IncludeDirs(cpp ? CPP : C_LANG, &include_dir_set);
-    for (const string& str: include_dir_set) {
-      final_includes.insert(str);
-      string path = NodeUtil::StripSpecialDirs(input(), str);
-      if (!path.empty()){
-	final_includes.insert(path);
-      }
-      final_includes.insert(Resource::FromLocalPath(
-          input().genfile_dir(), path).path());
-      final_includes.insert(Resource::FromLocalPath(
-          input().source_dir(), path).path());
+  for (const string& str: final_includes) {
+    if (str.empty()) LOG(FATAL) << "empty include dir";
+    include_dirs += (include_dirs.empty() ? "-I" : " -I") + str;
+  }
+  return include_dirs;
+}
+
+string CCLibraryNode::CompileArgFlags(bool cpp_mode) const {
+  set<string> header_compile_args;
+  CompileFlags(cpp_mode ? CPP : C_LANG, &header_compile_args);
+  return strings::JoinWith(
+      " ",
+      strings::JoinAll(header_compile_args, " "),
+      GetVariable(cpp_mode ? kCxxCompileArgs : kCCompileArgs).ref_name());
+}
+
+void CCLibraryNode::WritePrecompiledHeader(Makefile* out) const {
+  // Rule=> $(precompiled_header): header.h <input header files>
+  //   or, with compiler generated dependencies:
+  //     $(precompiled_header): header.h | <input header files>
+  //     -include stub.d
+  // The .gch/.pch must be built with exactly the flags of the objects that
+  // use it, otherwise gcc silently ignores it and clang refuses it.
+  Resource stub = PrecompiledHeaderStub();
+  Resource depfile = Resource::FromRootPath(stub.path() + ".d");
+  Makefile::Rule* rule = out->StartRule(
+      GetVariable(kPrecompiledHeader).ref_name(),
+      strings::JoinWith(
+          " ",
+          precompiled_header_.path(),
+          (FLAGS_cc_header_depfiles ? "|" : ""),
+          CompileVariableRef(kCompileInputs)));
+  rule->WriteCommand("mkdir -p " + stub.dirname());
+  rule->WriteCommand("echo '#include \"" + precompiled_header_.path() +
+                     "\"' > " + stub.path());
+  rule->WriteUserEcho("Precompiling", precompiled_header_.path());
+  rule->WriteCommand(strings::JoinWith(
+      " ",
+      DefaultCompileFlags(true),
+      CompileVariableRef(kCxxCompileFlags),
+      (FLAGS_cc_header_depfiles ? "-MMD -MP -MF " + depfile.path() : ""),
+      "-x c++-header",
+      stub.path(),
+      "-o " + GetVariable(kPrecompiledHeader).ref_name()));
+  out->FinishRule(rule);
+
+  if (FLAGS_cc_header_depfiles) {
+    out->append("-include " + depfile.path() + "\n");
+  }
+}
+
+ResourceFileSet CCLibraryNode::ModuleTargets() const {
+  // Header units produce only a module file, interfaces produce an object
+  // together with theirs.
+  ResourceFileSet targets;
+  for (const Resource& header : header_units_) {
+    targets.Add(ModuleFileForSource(header));
+  }
+  for (const Resource& source : module_interfaces_) {
+    targets.Add(ObjForSource(source));
+  }
+  return targets;
+}
+
+bool CCLibraryNode::HasModules() const {
+  return !module_interfaces_.empty() || !header_units_.empty();
+}
+
+bool CCLibraryNode::ScanModules() const {
+  if (HasModules()) {
+    return true;
+  }
+  vector<Node*> all_deps;
+  CollectAllDependencies(COMPILE_FLAGS, CPP, &all_deps);
+  for (const Node* node : all_deps) {
+    const CCLibraryNode* library = dynamic_cast<const CCLibraryNode*>(node);
+    if (library != NULL && library->HasModules()) {
+      return true;
     }
-    for (const string& str: final_includes) {
-      if (str.empty()) LOG(FATAL) << "empty include dir";
-      include_dirs += (include_dirs.empty() ? "-I" : " -I") + str;
+  }
+  return false;
+}
+
+void CCLibraryNode::InputHeaderUnits(ResourceFileSet* targets) const {
+  vector<Node*> all_deps;
+  CollectAllDependencies(COMPILE_FLAGS, CPP, &all_deps);
+  for (const Node* node : all_deps) {
+    const CCLibraryNode* library = dynamic_cast<const CCLibraryNode*>(node);
+    if (library != NULL) {
+      for (const Resource& header : library->header_units_) {
+        targets->Add(library->ModuleFileForSource(header));
+      }
     }
   }
+}
 
-  // Compile args
-  string output_compile_args;
-  {
-    set<string> header_compile_args;
-    CompileFlags(cpp ? CPP : C_LANG, &header_compile_args);
-    output_compile_args = strings::JoinWith(
-        " ",
-        strings::JoinAll(header_compile_args, " "),
-        GetVariable(cpp ? kCxxCompileArgs : kCCompileArgs).ref_name());
+void CCLibraryNode::WriteModuleScan(const Resource& source,
+                                    const Resource& obj,
+                                    const string& variant_args,
+                                    Makefile* out) const {
+  // Named modules are found by name in $(CXX_MODULE_CACHE), so the scan
+  // needs no list of them. Importing any header unit waits for all of
+  // those we can see.
+  ResourceFileSet header_units;
+  InputHeaderUnits(&header_units);
+  for (const Resource& header : header_units_) {
+    header_units.Add(ModuleFileForSource(header));
   }
 
-  // Actual make command.
-  rule->WriteUserEcho("Compiling",
-                      source.path() + " (" + (cpp ? "c++" : "c") + ")");
+  // Rule=> obj.modules: source | <input files>
+  //          $(COMPILE.cc) ... -E source | $(CC_MODULE_SCAN) obj ...
+  // make rereads its makefiles after updating obj.modules, except for
+  // "make clean", which skips the scans.
+  Resource scan = Resource::FromRootPath(obj.path() + ".modules");
+  string preprocessed = obj.path() + ".modules.i";
+  Makefile::Rule* rule = out->StartRule(
+      scan.path(),
+      strings::JoinWith(" ",
+                        source.path(),
+                        "|",
+                        CompileVariableRef(kCompileInputs),
+                        "$(CC_MODULE_SCAN)"));
+  rule->WriteCommand("mkdir -p " + scan.dirname());
   rule->WriteCommand(strings::JoinWith(
       " ",
-      compile,
-      include_dirs,
-      output_compile_args,
-      source.path(),
-      "-o " + (ephemeral_output ? ephemeral_dot_o : obj.path())));
+      DefaultCompileFlags(true), CompileVariableRef(kCxxCompileFlags),
+      variant_args, "-E -x c++", source.path(), "-o", preprocessed));
+  rule->WriteCommand(strings::JoinWith(
+      " ",
+      "$(CC_MODULE_SCAN)", obj.path(), "$(CXX_MODULE_CACHE)",
+      "$(CXX_MODULE_EXT)", strings::JoinAll(header_units.files(), " "),
+      "<", preprocessed, ">", scan.path() + ".tmp"));
+  rule->WriteCommand("mv -f " + scan.path() + ".tmp " + scan.path());
+  rule->WriteCommand("rm -f " + preprocessed);
+  out->FinishRule(rule);
+  out->append("-include $(if $(filter clean,$(MAKECMDGOALS)),," +
+              scan.path() + ")\n");
+}
 
-  if (ephemeral_output) {
-    rule->WriteCommand("mv " + ephemeral_dot_o + " " + obj.path());
+void CCLibraryNode::StripModuleDepfile(const Resource& depfile,
+                                       Makefile::Rule* rule) const {
+  // gcc lists imports as phony "<module>.c++m" targets, which would make
+  // importers always out of date. The scans already order and rebuild
+  // them, so drop those lines.
+  rule->WriteCommand("perl -ni -e 'print unless /\\.c\\+\\+m|^CXX_IMPORTS/' " +
+                     depfile.path());
+}
+
+Resource CCLibraryNode::ModuleFileForSource(const Resource& source) const {
+  return Resource::FromLocalPath(input().object_dir(),
+                                 StripSpecialDirs(source.path()) + ".pcm");
+}
+
+void CCLibraryNode::WriteModules(Makefile* out) const {
+  if (!HasModules()) {
+    return;
+  }
+
+  // Inputs: our dependencies and headers, but not our own module files.
+  ResourceFileSet input_files;
+  InputDependencyFiles(CPP, &input_files);
+  if (HasVariable(kHeaderVariable)) {
+    input_files.Add(Resource::FromRaw(
+        GetVariable(kHeaderVariable).ref_name()));
+  }
+  set<string> input_flags;
+  InputCompileFlags(CPP, &input_flags);
+  string compile_args = strings::JoinWith(
+      " ",
+      IncludeDirFlags(true),
+      strings::JoinAll(input_flags, " "),
+      GetVariable(kCxxCompileArgs).ref_name(),
+      "$(CXX_MODULE_ARGS)");
+
+  // Header units, which gcc writes to its module cache (the .pcm target
+  // only records that) and clang precompiles to the .pcm itself.
+  // Rule=> header.pcm: header.h <dependency header units> | <input files>
+  ResourceFileSet input_header_units;
+  InputHeaderUnits(&input_header_units);
+  for (const Resource& header : header_units_) {
+    Resource pcm = ModuleFileForSource(header);
+    Makefile::Rule* rule = out->StartRule(
+        pcm.path(),
+        strings::JoinWith(" ",
+                          header.path(),
+                          strings::JoinAll(input_header_units.files(), " "),
+                          "|",
+                          strings::JoinAll(input_files.files(), " ")));
+    rule->WriteCommand("mkdir -p " + pcm.dirname());
+    rule->WriteUserEcho("Compiling", header.path() + " (c++ header unit)");
+    rule->WriteCommand(strings::JoinWith(
+        " ",
+        DefaultCompileFlags(true), compile_args,
+        "$(CXX_HEADER_UNIT)", header.path(), "$(CXX_HEADER_UNIT_OUTPUT)"));
+    rule->WriteCommand("touch " + pcm.path());
+    out->FinishRule(rule);
+  }
+
+  // Module interfaces. Their scans order them after what they import, and
+  // the modules they export after them. gcc compiles an interface to its
+  // object, writing the module to its cache on the way; clang precompiles
+  // it into the cache and compiles that to the object.
+  // Rule=> interface.o: interface.cppm | <inputs>
+  for (const Resource& source : module_interfaces_) {
+    Resource obj = ObjForSource(source);
+    WriteModuleScan(source, obj, "", out);
+    Makefile::Rule* rule = out->StartRule(
+        obj.path(),
+        strings::JoinWith(" ",
+                          source.path(),
+                          "|",
+                          strings::JoinAll(input_files.files(), " ")));
+    rule->WriteCommand("mkdir -p " + obj.dirname() + " $(CXX_MODULE_CACHE)");
+    rule->WriteUserEcho("Compiling", source.path() + " (c++ module)");
+    rule->WriteCommand(strings::JoinWith(
+        " ",
+        DefaultCompileFlags(true), compile_args,
+        "-MMD -MP -MF " + DepfileForObj(obj).path(),
+        "$(CXX_MODULE_INTERFACE)", source.path(),
+        "-o $(CXX_MODULE_INTERFACE_OUTPUT)"));
+    rule->WriteCommand(strings::JoinWith(
+        " ",
+        "$(if $(CXX_MODULE_OUTPUT_$@),", DefaultCompileFlags(true),
+        "$(CXX_MODULE_ARGS) $(CXX_MODULE_OUTPUT_$@) -o $@)"));
+    StripModuleDepfile(DepfileForObj(obj), rule);
+    out->FinishRule(rule);
+    out->append("-include " + DepfileForObj(obj).path() + "\n");
+  }
+}
+
+void CCLibraryNode::WriteArchive(Makefile* out) const {
+  ResourceFileSet objects;
+  for (const Resource& source : module_interfaces_) {
+    objects.Add(ObjForSource(source));
+  }
+  for (const Resource& source : compile_sources_) {
+    if (!source.has_tag("ephemeral")) {
+      objects.Add(ObjForSource(source));
+    }
   }
+  CpuVariantObjectFiles(&objects);
 
+  // Rule=> lib.a: <objects>
+  //          rm -f lib.a; $(CC_ARCHIVE) lib.a <objects>
+  // We recreate the archive, so removed sources do not linger in it.
+  Resource archive = ObjArchive();
+  string object_list = strings::JoinAll(objects.files(), " ");
+  Makefile::Rule* rule = out->StartRule(archive.path(), object_list);
+  rule->WriteUserEcho("Archiving", archive.path());
+  rule->WriteCommand("mkdir -p " + archive.dirname());
+  rule->WriteCommand("rm -f " + archive.path());
+  rule->WriteCommand("$(CC_ARCHIVE) " + archive.path() + " " + object_list);
   out->FinishRule(rule);
+}
 
-  if (ephemeral_output) {
-    // Tell make to ignore any existing object file; i.e., force recompile.
-    out->append("\n.PHONY: ");
-    out->append(obj.path());
-    out->append("\n\n");
+void CCLibraryNode::WriteUnitySource(const Resource& unity_source,
+                                     const vector<Resource>& members,
+                                     Makefile* out) const {
+  // Rule=> unity.cc:
+  //          echo '#include "member.cc"' >> unity.cc.tmp ...
+  string tmp = unity_source.path() + ".tmp";
+  Makefile::Rule* rule = out->StartRule(unity_source.path());
+  rule->WriteCommand("mkdir -p " + unity_source.dirname());
+  rule->WriteCommand("echo '// Unity translation unit for " +
+                     target().full_path() + "' > " + tmp);
+  for (const Resource& member : members) {
+    rule->WriteCommand("echo '#include \"" + member.path() + "\"' >> " +
+                       tmp);
+  }
+  rule->WriteCommand("mv " + tmp + " " + unity_source.path());
+  out->FinishRule(rule);
+}
+
+void CCLibraryNode::InitCpuVariants() {
+  if (cpu_variants_.empty() || cpu_variant_sources_.empty() ||
+      cpu_variant_functions_.empty()) {
+    LOG(FATAL) << "cpu_variants, cpu_variant_sources and "
+               << "cpu_variant_functions go together in "
+               << target().full_path();
+  }
+  for (const string& variant : cpu_variants_) {
+    for (char c : variant) {
+      if (!isalnum(c) && c != '.') {
+        LOG(FATAL) << "Bad cpu_variant \"" << variant << "\" in "
+                   << target().full_path()
+                   << ", expected an -m flag (e.g. \"avx2\").";
+      }
+    }
+  }
+  set<string> sources;
+  for (const Resource& source : sources_) {
+    sources.insert(source.path());
+  }
+  for (const Resource& source : cpu_variant_sources_) {
+    if (sources.count(source.path()) > 0) {
+      LOG(FATAL) << source.path() << " is in both cc_sources and "
+                 << "cpu_variant_sources of " << target().full_path()
+                 << ", list it only in cpu_variant_sources.";
+    }
+  }
+  for (const string& function : cpu_variant_functions_) {
+    for (const string& part : SplitQualifiedName(function)) {
+      if (part.empty() || isdigit(part[0]) ||
+          part.find_first_not_of(
+              "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ"
+              "0123456789_") != string::npos) {
+        LOG(FATAL) << "Bad cpu_variant_function \"" << function << "\" in "
+                   << target().full_path()
+                   << ", expected a qualified name (e.g. \"foo::Sum\").";
+      }
+    }
+  }
+
+  // Named after its contents, like unity sources, so a change to our
+  // variants or functions produces a new file.
+  string dispatch_name = strings::StringPrintf(
+      "%s.cpu_dispatch_%08x.cc",
+      target().local_path().c_str(),
+      StableHash(strings::JoinAll(CpuDispatchSource(), "\n")));
+  cpu_dispatch_source_ = Resource::FromLocalPath(GenDir(), dispatch_name);
+  cpu_dispatch_source_.add_tag("nounity");
+  sources_.push_back(cpu_dispatch_source_);
+}
+
+vector<string> CCLibraryNode::CpuVariantNamespaces() const {
+  vector<string> namespaces(1, "cpu_baseline");
+  for (const string& variant : cpu_variants_) {
+    namespaces.push_back("cpu_" + CpuVariantName(variant));
+  }
+  return namespaces;
+}
+
+vector<string> CCLibraryNode::CpuDispatchSource() const {
+  // For "foo::Sum", and cpu_variants [ "avx2" ]:
+  //   namespace foo { namespace cpu_avx2 { decltype(::foo::Sum) Sum; } }
+  //   ...
+  //   extern "C" void* repobuild_cpu_dispatch_foo_Sum() {
+  //     __builtin_cpu_init();
+  //     if (__builtin_cpu_supports("avx2")) return ...&::foo::cpu_avx2::Sum;
+  //     return ...&::foo::cpu_baseline::Sum;
+  //   }
+  //   namespace foo {
+  //   decltype(::foo::Sum) Sum
+  //       __attribute__((ifunc("repobuild_cpu_dispatch_foo_Sum")));
+  //   }
+  vector<string> lines;
+  lines.push_back("// cpu_variants dispatch for " + target().full_path());
+  lines.push_back("#ifndef __ELF__");
+  lines.push_back("#error cpu_variants needs ifunc support (ELF targets).");
+  lines.push_back("#endif");
+  for (const Resource& header : headers_) {
+    lines.push_back("#include \"" + header.path() + "\"");
+  }
+  for (const string& function : cpu_variant_functions_) {
+    vector<string> parts = SplitQualifiedName(function);
+    string name = parts.back();
+    parts.pop_back();
+    string namespace_start, namespace_end;
+    for (const string& part : parts) {
+      namespace_start += "namespace " + part + " { ";
+      namespace_end += " }";
+    }
+    string qualified = "::" + function;
+    string prefix = "::" + strings::JoinAll(parts, "::") +
+        (parts.empty() ? "" : "::");
+    string resolver = "repobuild_cpu_dispatch_" + strings::JoinAll(parts, "_") +
+        (parts.empty() ? "" : "_") + name;
+
+    for (const string& ns : CpuVariantNamespaces()) {
+      lines.push_back(namespace_start + "namespace " + ns + " { decltype(" +
+                      qualified + ") " + name + "; }" + namespace_end);
+    }
+    lines.push_back("extern \"C\" void* " + resolver + "() {");
+    lines.push_back("#if defined(__x86_64__) || defined(__i386__)");
+    lines.push_back("  __builtin_cpu_init();");
+    for (int i = cpu_variants_.size() - 1; i >= 0; --i) {
+      lines.push_back("  if (__builtin_cpu_supports(\"" + cpu_variants_[i] +
+                      "\")) return reinterpret_cast<void*>(&" + prefix +
+                      "cpu_" + CpuVariantName(cpu_variants_[i]) + "::" +
+                      name + ");");
+    }
+    lines.push_back("#endif");
+    lines.push_back("  return reinterpret_cast<void*>(&" + prefix +
+                    "cpu_baseline::" + name + ");");
+    lines.push_back("}");
+    lines.push_back(namespace_start + "decltype(" + qualified + ") " + name +
+                    " __attribute__((ifunc(\"" + resolver + "\")));" +
+                    namespace_end);
+  }
+  return lines;
+}
+
+void CCLibraryNode::WriteCpuVariants(Makefile* out) const {
+  // Rule=> dispatch.cc:
+  //          echo '<line>' >> dispatch.cc.tmp ...
+  string tmp = cpu_dispatch_source_.path() + ".tmp";
+  Makefile::Rule* rule = out->StartRule(cpu_dispatch_source_.path());
+  rule->WriteCommand("mkdir -p " + cpu_dispatch_source_.dirname());
+  rule->WriteCommand("rm -f " + tmp);
+  for (const string& line : CpuDispatchSource()) {
+    rule->WriteCommand("echo '" + line + "' >> " + tmp);
+  }
+  rule->WriteCommand("mv " + tmp + " " + cpu_dispatch_source_.path());
+  out->FinishRule(rule);
+
+  // One compile per source and variant, the first being the baseline.
+  vector<string> namespaces = CpuVariantNamespaces();
+  for (int i = 0; i < namespaces.size(); ++i) {
+    string variant_dir = strings::JoinPath(input().object_dir(),
+                                           namespaces[i]);
+    if (i == 0) {
+      for (const Resource& source : cpu_variant_sources_) {
+        WriteCompile(source, VariantObj(variant_dir, source),
+                     "-DREPOBUILD_CPU_VARIANT=" + namespaces[i], "",
+                     ResourceFileSet(), out);
+      }
+      continue;
+    }
+
+    // The inline and template code a variant compiles (e.g. from headers) is
+    // weak, and the linker keeps one copy of each: it could be ours, built
+    // with -m<variant>, and then run on cpus without it. So we rename our
+    // weak definitions (and their COMDAT groups, and vtables) to
+    // <name>.<namespace>. Weak data, e.g. function static variables, stays
+    // shared. objcopy can't rename LTO objects, hence -fno-lto.
+    string variant_args = strings::JoinWith(
+        " ",
+        "-m" + cpu_variants_[i - 1],
+        "-fno-lto",
+        "-DREPOBUILD_CPU_VARIANT=" + namespaces[i]);
+    for (const Resource& source : cpu_variant_sources_) {
+      Resource obj = VariantObj(variant_dir, source);
+      Resource compiled = VariantObj(
+          strings::JoinPath(variant_dir, "compiled"), source);
+      WriteCompile(source, compiled, variant_args, "", ResourceFileSet(), out);
+
+      // Rule=> obj: compiled
+      //          nm compiled | awk <weak code> > obj.syms
+      //          objcopy --redefine-syms=obj.syms compiled obj
+      string syms = obj.path() + ".syms";
+      Makefile::Rule* rule = out->StartRule(obj.path(), compiled.path());
+      rule->WriteCommand("mkdir -p " + obj.dirname());
+      rule->WriteCommand(
+          "nm --defined-only " + compiled.path() + " | awk '"
+          "$$2 == \"W\" || $$2 == \"n\" || "
+          "($$2 == \"V\" && $$3 ~ /^_ZT[VTC]/) "
+          "{ print $$3, $$3 \"." + namespaces[i] + "\" }' > " + syms);
+      rule->WriteCommand("objcopy --redefine-syms=" + syms + " " +
+                         compiled.path() + " " + obj.path());
+      rule->WriteCommand("rm -f " + syms);
+      out->FinishRule(rule);
+    }
+  }
+}
+
+void CCLibraryNode::CpuVariantObjectFiles(ResourceFileSet* files) const {
+  if (cpu_variant_sources_.empty()) {
+    return;
+  }
+  for (const string& ns : CpuVariantNamespaces()) {
+    string variant_dir = strings::JoinPath(input().object_dir(), ns);
+    for (const Resource& source : cpu_variant_sources_) {
+      files->Add(VariantObj(variant_dir, source));
+    }
   }
 }
 
@@ -293,8 +1107,19 @@ void CCLibraryNode::LocalDependencyFiles(LanguageType lang,
 
 void CCLibraryNode::LocalObjectFiles(LanguageType lang,
                                      ResourceFileSet* files) const {
-  for (const Resource& src : sources_) {
-    files->Add(ObjForSource(src));
+  bool archive = ArchiveObjects();
+  if (archive) {
+    files->Add(ObjArchive());
+  } else {
+    for (const Resource& source : module_interfaces_) {
+      files->Add(ObjForSource(source));
+    }
+    CpuVariantObjectFiles(files);
+  }
+  for (const Resource& src : compile_sources_) {
+    if (!archive || src.has_tag("ephemeral")) {
+      files->Add(ObjForSource(src));
+    }
   }
   for (const Resource& obj : objects_) {
     files->Add(obj);
@@ -377,28 +1202,63 @@ string JoinFlags(const vector<string>& flags,
   return out;
 }
 
-string WriteLdflag(const Input& input, bool gcc) {
-  string out = "LDFLAGS=";
-  out.append(JoinFlags(input.flags("-L"), gcc, false));
+// With a build configuration, we append its flags (-C.<config>=...) to the
+// common ones.
+string FlagKey(const string& key, const string& config) {
+  return config.empty() ? key : key + "." + config;
+}
+
+string Assign(const string& config) {
+  return config.empty() ? "=" : "+=";
+}
+
+string WriteLdflag(const Input& input, const string& config, bool gcc) {
+  string out = "LDFLAGS" + Assign(config);
+  out.append(JoinFlags(input.flags(FlagKey("-L", config)), gcc, false));
   out.append("\n");
   return out;
 }
 
-string WriteCflag(const Input& input, bool gcc, bool basic) {
-  string out = (basic ? "BASIC_CFLAGS=" : "CFLAGS=");
-  out.append(JoinFlags(input.flags("-C"), gcc, basic));
+string WriteCflag(const Input& input, const string& config,
+                  bool gcc, bool basic) {
+  string out = (basic ? "BASIC_CFLAGS" : "CFLAGS") + Assign(config);
+  out.append(JoinFlags(input.flags(FlagKey("-C", config)), gcc, basic));
   out.append("\n");
   return out;
 }
 
-string WriteCxxflag(const Input& input, bool gcc, bool basic) {
-  string out = (basic ? "BASIC_CXXFLAGS=" : "CXXFLAGS=");
-  out.append(JoinFlags(input.flags("-C"), gcc, basic));
-  out.append(JoinFlags(input.flags("-X"), gcc, basic));
+string WriteCxxflag(const Input& input, const string& config,
+                    bool gcc, bool basic) {
+  string out = (basic ? "BASIC_CXXFLAGS" : "CXXFLAGS") + Assign(config);
+  out.append(JoinFlags(input.flags(FlagKey("-C", config)), gcc, basic));
+  out.append(JoinFlags(input.flags(FlagKey("-X", config)), gcc, basic));
   out.append("\n");
   return out;
 }
 
+// CFLAGS, CXXFLAGS and LDFLAGS (and their BASIC_ versions), for gcc or
+// clang.
+string WriteCompilerFlags(const Input& input, const string& config) {
+  string out;
+  out.append("ifeq ($(" + string(kCGcc) + "),1)\n");
+  out.append("\t" + WriteCflag(input, config, true, false));
+  out.append("\t" + WriteCflag(input, config, true, true));
+  out.append("else\n");
+  out.append("\t" + WriteCflag(input, config, false, false));
+  out.append("\t" + WriteCflag(input, config, false, true));
+  out.append("endif\n");
+  out.append("ifeq ($(" + string(kCxxGcc) + "),1)\n");
+  out.append("\t" + WriteLdflag(input, config, true));
+  out.append("\t" + WriteCxxflag(input, config, true, false));
+  out.append("\t" + WriteCxxflag(input, config, true, true));
+  out.append("else\n");
+  out.append("\t" + WriteLdflag(input, config, false));
+  out.append("\t" + WriteCxxflag(input, config, false, false));
+  out.append("\t" + WriteCxxflag(input, config, false, true));
+  out.append("endif\n");
+  return out;
+}
+
 }  // anonymous namespace
 
 // static
@@ -410,31 +1270,202 @@ void CCLibraryNode::WriteMakeHead(const Input& input, Makefile* out) {
   out->append(string(kCGcc) + " := $(shell echo $$($(CC) --version | "
               "egrep '(gcc|g\\+\\+|^cc)' | head -n 1 | wc -l))\n");
 
-  // Write the global values
-  // CFLAGS:
-  out->append("ifeq ($(" + string(kCGcc) + "),1)\n");
-  out->append("\t" + WriteCflag(input, true, false));
-  out->append("\t" + WriteCflag(input, true, true));
-  out->append("else\n");
-  out->append("\t" + WriteCflag(input, false, false));
-  out->append("\t" + WriteCflag(input, false, true));
-  out->append("endif\n");
+  // Write the global values: CFLAGS, CXXFLAGS and LDFLAGS.
+  out->append(WriteCompilerFlags(input, ""));
+
+  // The gold linker used by clang also supports whole-archive
+  out->append("LD_FORCE_LINK_START := -Wl,--whole-archive\n");
+  out->append("LD_FORCE_LINK_END := -Wl,--no-whole-archive\n\n");
+
+  // And those of our build configuration (CONFIG).
+  for (const string& config : input.configs()) {
+    if (input.flags(FlagKey("-C", config)).empty() &&
+        input.flags(FlagKey("-X", config)).empty() &&
+        input.flags(FlagKey("-L", config)).empty()) {
+      continue;
+    }
+    out->append("ifeq ($(CONFIG)," + config + ")\n");
+    out->append(WriteCompilerFlags(input, config));
+    out->append("endif\n");
+  }
+  out->append("\n");
 
-  // CXXFLAGS and LDFLAGS
+  // Fast link profile, "make CC_FAST_LINK=1". The linker is picked per
+  // compiler at make time; --gdb-index needs one of these linkers, ld.bfd
+  // does not support it.
+  out->append("CC_FAST_LINK ?= " + string(FLAGS_cc_fast_link ? "1" : "0") +
+              "\n");
+  out->append("ifeq ($(CC_FAST_LINK)$(shell uname),1Linux)\n");
+  out->append("\tFAST_LINKER := $(shell for l in mold lld gold; do "
+              "$(CXX) -fuse-ld=$$l -Wl,--version 2>/dev/null | "
+              "grep -q . && echo $$l && break; done)\n");
+  out->append("\tCFLAGS += -gsplit-dwarf\n");
+  out->append("\tCXXFLAGS += -gsplit-dwarf\n");
+  out->append("\tLDFLAGS += -Wl,--compress-debug-sections=zlib\n");
+  out->append("\tifneq ($(FAST_LINKER),)\n");
+  out->append("\t\tCFLAGS += -ggnu-pubnames\n");
+  out->append("\t\tCXXFLAGS += -ggnu-pubnames\n");
+  out->append("\t\tLDFLAGS += -fuse-ld=$(FAST_LINKER) -Wl,--gdb-index\n");
+  out->append("\tendif\n");
+  out->append("endif\n\n");
+
+  // ThinLTO cache (see Input::AddLtoFlags), in the options of the linker
+  // in use: ld64 and lld have one, ld.bfd and gold reject the lld option.
+  string thinlto_cache = strings::JoinPath(input.object_dir(),
+                                           "thinlto-cache");
+  out->append("ifneq ($(" + string(kCxxGcc) + "),1)\n");
+  out->append("\tifeq ($(shell uname),Darwin)\n");
+  out->append("\t\tTHINLTO_CACHE := -Wl,-cache_path_lto," + thinlto_cache +
+              "\n");
+  out->append("\telse ifneq ($(findstring LLD,$(shell $(CXX) $(LDFLAGS) "
+              "-Wl,--version 2>/dev/null)),)\n");
+  out->append("\t\tTHINLTO_CACHE := -Wl,--thinlto-cache-dir=" +
+              thinlto_cache + "\n");
+  out->append("\tendif\n");
+  out->append("endif\n\n");
+
+  // Compile time traces, "make CC_TIME_TRACE=1". These go at the end of
+  // the compile command: gcc prints its report to stderr, so we keep the
+  // report and pass everything before it (warnings) through.
+  out->append("CC_TIME_TRACE ?= " + string(FLAGS_cc_time_trace ? "1" : "0") +
+              "\n");
+  out->append("GCC_TIME_TRACE = -ftime-report 2> $@.time-trace; s=$$?; "
+              "sed -e '/^Time variable/,$$d' -e '/^$$/d' $@.time-trace >&2; "
+              "exit $$s\n");
+  out->append("CLANG_TIME_TRACE = -ftime-trace && "
+              "mv $(basename $@).json $@.time-trace\n");
+  out->append("ifeq ($(CC_TIME_TRACE),1)\n");
+  out->append("\tC_TIME_TRACE = $(if $(filter 1,$(" + string(kCGcc) +
+              ")),$(GCC_TIME_TRACE),$(CLANG_TIME_TRACE))\n");
+  out->append("\tCXX_TIME_TRACE = $(if $(filter 1,$(" + string(kCxxGcc) +
+              ")),$(GCC_TIME_TRACE),$(CLANG_TIME_TRACE))\n");
+  out->append("endif\n\n");
+
+  // Distributed compiles, "make -j<N> CC_WORKERS=host:port,...". Objects
+  // are preprocessed here and compiled by the workers; N may exceed our own
+  // cpu count, since compiles wait for a free worker before running here.
+  string worker_script = strings::JoinPath(input.genfile_dir(),
+                                           "cc_worker.pl");
+  out->GenerateExecFile("CCWorkerScript", worker_script,
+                        string(embed_cc_worker_pl_data(),
+                               embed_cc_worker_pl_size()));
+  out->append("CC_WORKERS ?= " + FLAGS_cc_workers + "\n");
+  out->append("ifneq ($(CC_WORKERS),)\n");
+  out->append("\texport CC_WORKERS\n");
+  out->append("\tCC_WORKER_SCRIPT := " + worker_script + "\n");
+  out->append("\tCC_LAUNCHER := $(CC_WORKER_SCRIPT) compile\n");
+  out->append("endif\n\n");
+
+  // C++20 modules, with their module cache in the object dir. gcc finds
+  // modules through its module mapper. clang's are precompiled into the
+  // cache, and each compile is given those it imports (-fmodule-file, from
+  // its scan), with the cache as the fallback for indirect imports.
+  // Compiles that import get $(CXX_MODULE_ARGS), see WriteModuleScan.
+  string module_scan = strings::JoinPath(input.genfile_dir(),
+                                         "cc_module_scan.pl");
+  out->GenerateExecFile("CCModuleScan", module_scan, kModuleScanScript);
+  out->append("CC_MODULE_SCAN := " + module_scan + "\n");
   out->append("ifeq ($(" + string(kCxxGcc) + "),1)\n");
-  out->append("\tLD_FORCE_LINK_START := -Wl,--whole-archive\n");
-  out->append("\tLD_FORCE_LINK_END := -Wl,--no-whole-archive\n");
-  out->append("\t" + WriteLdflag(input, true));
-  out->append("\t" + WriteCxxflag(input, true, false));
-  out->append("\t" + WriteCxxflag(input, true, true));
+  out->append("\tCXX_MODULE_CACHE := " +
+              strings::JoinPath(input.object_dir(), "gcm.cache") + "\n");
+  out->append("\tCXX_MODULE_EXT := gcm\n");
+  out->append("\tCXX_MODULE_ARGS = -std=c++20 -fmodules-ts "
+              "'-fmodule-mapper=|@g++-mapper-server -r $(CXX_MODULE_CACHE)'"
+              "\n");
+  out->append("\tCXX_MODULE_INTERFACE = -x c++\n");
+  out->append("\tCXX_MODULE_INTERFACE_OUTPUT = $@\n");
+  out->append("\tCXX_HEADER_UNIT = -x c++-user-header\n");
+  out->append("\tCXX_HEADER_UNIT_OUTPUT =\n");
   out->append("else\n");
-  // The gold linker used by clang also supports whole-archive
-  out->append("\tLD_FORCE_LINK_START := -Wl,--whole-archive\n");
-  out->append("\tLD_FORCE_LINK_END := -Wl,--no-whole-archive\n");
-  out->append("\t" + WriteLdflag(input, false));
-  out->append("\t" + WriteCxxflag(input, false, false));
-  out->append("\t" + WriteCxxflag(input, false, true));
+  out->append("\tCXX_MODULE_CACHE := " +
+              strings::JoinPath(input.object_dir(), "pcm.cache") + "\n");
+  out->append("\tCXX_MODULE_EXT := pcm\n");
+  out->append("\tCXX_MODULE_ARGS = -std=c++20 "
+              "-fprebuilt-module-path=$(CXX_MODULE_CACHE) "
+              "$(CXX_MODULE_FILES_$@)\n");
+  out->append("\tCXX_MODULE_INTERFACE = --precompile -x c++-module\n");
+  out->append("\tCXX_MODULE_INTERFACE_OUTPUT = $(CXX_MODULE_OUTPUT_$@)\n");
+  out->append("\tCXX_HEADER_UNIT = --precompile -x c++-user-header\n");
+  out->append("\tCXX_HEADER_UNIT_OUTPUT = -o $@\n");
+  out->append("endif\n\n");
+
+  // Objects of ephemeral_cc_sources depend on this stamp, which is touched
+  // once per make run. Each is compiled once per build, and shared by every
+  // binary that links it.
+  string ephemeral_stamp = strings::JoinPath(input.object_dir(),
+                                             ".ephemeral_stamp");
+  out->append("EPHEMERAL_STAMP := " + ephemeral_stamp + "\n");
+  Makefile::Rule* stamp = out->StartRawRule(ephemeral_stamp,
+                                            "FORCE_EPHEMERAL");
+  stamp->WriteCommand("mkdir -p " + strings::PathDirname(ephemeral_stamp));
+  stamp->WriteCommand("touch " + ephemeral_stamp);
+  out->FinishRule(stamp);
+  out->append(".PHONY: FORCE_EPHEMERAL\n\n");
+
+  // Build metadata for the cc_binary linkstamp. Volatile values use "=",
+  // so they are evaluated by each link.
+  out->append("LINKSTAMP ?= " + FLAGS_cc_linkstamp + "\n");
+  out->append("ifeq ($(LINKSTAMP),volatile)\n");
+  out->append("\tLINKSTAMP_USER = $(shell id -u -n)\n");
+  out->append("\tLINKSTAMP_TIMESTAMP = $(shell date --rfc-3339=seconds)\n");
+  out->append("else ifneq ($(SOURCE_DATE_EPOCH),)\n");
+  out->append("\tLINKSTAMP_TIMESTAMP := $(shell date -u "
+              "-d @$(SOURCE_DATE_EPOCH) --rfc-3339=seconds)\n");
   out->append("endif\n\n");
+
+  // Declarations of the linkstamp symbols, for #include
+  // "repobuild/linkstamp.h". Generated before any compile.
+  static const char* const kLinkstampHeader[] = {
+    "// Build metadata of the linking cc_binary, from its linkstamp.",
+    "#ifndef REPOBUILD_LINKSTAMP_H__",
+    "#define REPOBUILD_LINKSTAMP_H__",
+    "#ifdef __cplusplus",
+    "extern \"C\" {",
+    "#endif",
+    "extern const char repobuild_build_target[];",
+    "extern const char repobuild_build_user[];",
+    "extern const char repobuild_build_timestamp[];",
+    "#ifdef __cplusplus",
+    "}",
+    "#endif",
+    "#endif  // REPOBUILD_LINKSTAMP_H__",
+  };
+  string linkstamp_header = strings::JoinPath(input.genfile_dir(),
+                                              "repobuild/linkstamp.h");
+  string header_lines;
+  for (const char* line : kLinkstampHeader) {
+    header_lines += " '" + string(line) + "'";
+  }
+  Makefile::Rule* header = out->StartPrereqRule(linkstamp_header, "");
+  header->WriteCommand("mkdir -p " + strings::PathDirname(linkstamp_header));
+  header->WriteCommand("printf '%s\\n'" + header_lines + " > " +
+                       linkstamp_header);
+  out->FinishRule(header);
+
+  // Archiver for cc_library objects. LTO objects need the compiler's
+  // archiver (its linker plugin) for a symbol index. Darwin's ar reads
+  // bitcode itself, but has no thin archives.
+  if (FLAGS_cc_link_archives == "thin" ||
+      FLAGS_cc_link_archives == "static") {
+    out->append("ifeq ($(" + string(kCxxGcc) + "),1)\n");
+    out->append("\tCC_AR := $(shell command -v gcc-ar 2>/dev/null || "
+                "echo $(AR))\n");
+    out->append("else\n");
+    out->append("\tCC_AR := $(shell command -v llvm-ar 2>/dev/null || "
+                "echo $(AR))\n");
+    out->append("endif\n");
+  }
+  if (FLAGS_cc_link_archives == "thin") {
+    out->append("ifeq ($(shell uname),Darwin)\n");
+    out->append("\tCC_ARCHIVE := $(CC_AR) rcs\n");
+    out->append("else\n");
+    out->append("\tCC_ARCHIVE := $(CC_AR) rcsT\n");
+    out->append("endif\n\n");
+  } else if (FLAGS_cc_link_archives == "static") {
+    out->append("CC_ARCHIVE := $(CC_AR) rcs\n\n");
+  } else if (FLAGS_cc_link_archives != "none") {
+    LOG(FATAL) << "Unknown --cc_link_archives: " << FLAGS_cc_link_archives;
+  }
 }
 
 Resource CCLibraryNode::ObjForSource(const Resource& source) const {
@@ -444,12 +1475,50 @@ Resource CCLibraryNode::ObjForSource(const Resource& source) const {
   return r;
 }
 
+bool CCLibraryNode::ArchiveObjects() const {
+  if (FLAGS_cc_link_archives == "none") {
+    return false;
+  }
+  if (!module_interfaces_.empty()) {
+    return true;
+  }
+  for (const Resource& source : compile_sources_) {
+    if (!source.has_tag("ephemeral")) {
+      return true;
+    }
+  }
+  return false;
+}
+
+Resource CCLibraryNode::ObjArchive() const {
+  Resource r = Resource::FromLocalPath(
+      ObjectDir(), "lib" + target().local_path() + ".a");
+  r.add_tag("archive");
+  if (!compile_sources_.empty() &&
+      compile_sources_[0].has_tag("alwayslink")) {
+    r.add_tag("alwayslink");
+  }
+  return r;
+}
+
+Resource CCLibraryNode::DepfileForObj(const Resource& obj) const {
+  CHECK(strings::HasSuffix(obj.path(), ".o")) << obj;
+  return Resource::FromRootPath(
+      obj.path().substr(0, obj.path().size() - 2) + ".d");
+}
+
+Resource CCLibraryNode::PrecompiledHeaderStub() const {
+  return Resource::FromLocalPath(
+      strings::JoinPath(ObjectDir(), target().local_path() + ".pch"),
+      precompiled_header_.basename());
+}
+
 void CCLibraryNode::AddVariable(const string& cpp_name,
                                 const string& c_name,
                                 const string& gcc_value,
                                 const string& clang_value) {
-  AddConditionalVariable(cpp_name, kCxxGcc, gcc_value, clang_value);
-  AddConditionalVariable(c_name, kCGcc, gcc_value, clang_value);
+  AddConditionalMakeVariable(cpp_name, kCxxGcc, gcc_value, clang_value);
+  AddConditionalMakeVariable(c_name, kCGcc, gcc_value, clang_value);
 }
 
 
@@ -4,6 +4,7 @@
 #ifndef _REPOBUILD_NODES_CC_LIBRARY_H__
 #define _REPOBUILD_NODES_CC_LIBRARY_H__
 
+#include <map>
 #include <string>
 #include <set>
 #include <vector>
@@ -16,11 +17,13 @@ class CCLibraryNode : public Node {
   CCLibraryNode(const TargetInfo& t,
                 const Input& i,
                 DistSource* source)
-      : Node(t, i, source) {
+      : Node(t, i, source),
+        unity_batch_size_(0) {
   }
   virtual ~CCLibraryNode() {}
   virtual void Parse(BuildFile* file, const BuildFileNode& input);
   virtual void LocalWriteMake(Makefile* out) const;
+  virtual void LocalWriteMakeVariables(Makefile* out) const;
   virtual void LocalDependencyFiles(LanguageType lang,
                                     ResourceFileSet* files) const;
   virtual void LocalObjectFiles(LanguageType lang,
@@ -32,7 +35,7 @@ class CCLibraryNode : public Node {
   virtual void LocalIncludeDirs(LanguageType lang,
                                 std::set<std::string>* flags) const;
 
-  // Alterative to Parse()
+  // Alterative to Parse(), the args are makefile text.
   void Set(const std::vector<Resource>& sources,
            const std::vector<Resource>& headers,
            const std::vector<Resource>& objects,
@@ -43,25 +46,118 @@ class CCLibraryNode : public Node {
   void PreInitSources(const ResourceFileSet& sources,
                       const ResourceFileSet& headers);
 
+  // Likewise for linker args (e.g. libraries our generated sources need).
+  void PreInitLinkerArgs(const std::vector<std::string>& args);
+
   // Static preprocessors
   static void WriteMakeHead(const Input& input, Makefile* out);
 
+  // Build variants (e.g. instrumented objects for profile guided
+  // optimization): our sources compiled again into variant_dir, with extra
+  // compile args, and additional prerequisites for each object.
+  void WriteVariantCompiles(const std::string& variant_dir,
+                            const std::string& variant_args,
+                            const std::string& variant_prereqs,
+                            Makefile* out) const;
+  void VariantObjectFiles(const std::string& variant_dir,
+                          ResourceFileSet* files) const;
+
  protected:
   void Init();
   std::string DefaultCompileFlags(bool cpp_mode) const;
   void WriteCompile(const Resource& source,
-                    const ResourceFileSet& input_files,
+                    const Resource& obj,
+                    const std::string& variant_args,
+                    const std::string& variant_prereqs,
+                    const ResourceFileSet& extra_input_files,
                     Makefile* out) const;
   void LocalWriteMakeInternal(bool should_write_target, Makefile* out) const;
   Resource ObjForSource(const Resource& source) const;
+  Resource VariantObj(const std::string& variant_dir,
+                      const Resource& source) const;
+
+  // C++20 modules (gcc and clang): rules for cc_header_units and
+  // cc_module_interfaces. When we or our dependencies have modules, each
+  // c++ object also gets a scan of its preprocessed source for imports
+  // (<obj>.modules, an included makefile), which orders it after the
+  // modules it imports and gives it the module compile args.
+  void WriteModules(Makefile* out) const;
+  ResourceFileSet ModuleTargets() const;
+  bool HasModules() const;
+  bool ScanModules() const;
+  void InputHeaderUnits(ResourceFileSet* targets) const;
+  void WriteModuleScan(const Resource& source,
+                       const Resource& obj,
+                       const std::string& variant_args,
+                       Makefile* out) const;
+  void StripModuleDepfile(const Resource& depfile,
+                          Makefile::Rule* rule) const;
+  Resource ModuleFileForSource(const Resource& source) const;
+
+  // Static archive of our objects, which dependents link instead of the
+  // objects themselves. Binaries and shared libraries do not archive.
+  virtual bool ArchiveObjects() const;
+  Resource ObjArchive() const;
+  void WriteArchive(Makefile* out) const;
+  Resource DepfileForObj(const Resource& obj) const;
+  std::string IncludeDirFlags(bool cpp_mode) const;
+  std::string CompileArgFlags(bool cpp_mode) const;
+
+  // Input files, include dirs and compile flags of our compile rules, as
+  // per-node make variables (e.g. $(cxx_compile_flags.path/to/lib)).
+  void WriteCompileVariables(const ResourceFileSet& input_files,
+                             Makefile* out) const;
+  std::string CompileVariable(const std::string& name) const;
+  std::string CompileVariableRef(const std::string& name) const;
+
+  // Precompiled header support. The stub is a one-line header in our object
+  // directory that includes precompiled_header_; the compiler looks for
+  // <stub>.gch (gcc) or <stub>.pch (clang) next to it when we "-include" it.
+  Resource PrecompiledHeaderStub() const;
+  void WritePrecompiledHeader(Makefile* out) const;
+
+  // Unity builds. Groups c++ sources into unity translation units, filling
+  // in compile_sources_ and unity_members_.
+  void InitUnitySources();
+  void WriteUnitySource(const Resource& unity_source,
+                        const std::vector<Resource>& members,
+                        Makefile* out) const;
   void AddVariable(const std::string& cpp_name,
                    const std::string& c_name,
                    const std::string& gcc_value,
                    const std::string& clang_value);
 
+  // cpu_variants: cpu_variant_sources are compiled once per variant (with
+  // -m<variant>) and once for the baseline, each inside its own namespace
+  // (-DREPOBUILD_CPU_VARIANT=cpu_<variant>). A generated dispatch source
+  // defines each of cpu_variant_functions as a gnu ifunc, which picks the
+  // best variant the cpu supports when the binary is loaded. Variant objects
+  // keep their inline and template code to themselves (see
+  // WriteCpuVariants), are not LTO'd, and a cpu_variant_source can't also be
+  // in cc_sources.
+  void InitCpuVariants();
+  void WriteCpuVariants(Makefile* out) const;
+  void CpuVariantObjectFiles(ResourceFileSet* files) const;
+  std::vector<std::string> CpuVariantNamespaces() const;
+  std::vector<std::string> CpuDispatchSource() const;
+
   std::vector<Resource> sources_;
   std::vector<Resource> headers_;
   std::vector<Resource> objects_;
+  std::vector<Resource> module_interfaces_;
+  std::vector<Resource> header_units_;
+  Resource precompiled_header_;
+
+  std::vector<std::string> cpu_variants_;
+  std::vector<Resource> cpu_variant_sources_;
+  std::vector<std::string> cpu_variant_functions_;
+  Resource cpu_dispatch_source_;
+
+  // What we actually compile: sources_, with any sources that were batched
+  // into a unity translation unit replaced by that unit.
+  int unity_batch_size_;
+  std::vector<Resource> compile_sources_;
+  std::map<std::string, std::vector<Resource> > unity_members_;
 
   std::vector<std::string> cc_include_dirs_;
 
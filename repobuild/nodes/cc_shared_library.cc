@@ -27,6 +27,11 @@ namespace {
 const char kCxxGcc[] = "CXX_GCC";
 const char kIsDarwin[] = "IS_DARWIN";
 const char kIsDarwinAndClang[] = "IS_DARWIN_AND_CLANG";
+
+// Compile args for "visibility": "hidden". A section per function and
+// variable lets the linker drop whatever the exported symbols do not use.
+const char kHiddenCompileArgs[] =
+    "-fvisibility=hidden -ffunction-sections -fdata-sections";
 }
 
 void CCSharedLibraryNode::Parse(BuildFile* file, const BuildFileNode& input) {
@@ -43,6 +48,16 @@ void CCSharedLibraryNode::Parse(BuildFile* file, const BuildFileNode& input) {
     exported_symbols_ = tmp_symbols[0];
   }
 
+  // Visibility.
+  string visibility;
+  current_reader()->ParseStringField("visibility", &visibility);
+  if (visibility == "hidden") {
+    hidden_visibility_ = true;
+  } else if (!visibility.empty() && visibility != "default") {
+    LOG(FATAL) << "visibility must be \"default\" or \"hidden\" in "
+               << target().full_path() << ", found \"" << visibility << "\".";
+  }
+
   // Versioning.
   current_reader()->ParseStringField("release_version", &release_version_);
   current_reader()->ParseStringField("minor_version", &minor_version_);
@@ -110,15 +125,49 @@ void CCSharedLibraryNode::LocalWriteMake(Makefile* out) const {
 
 void CCSharedLibraryNode::WriteLink(Makefile* out) const {
   ResourceFileSet objects;
-  CCLibraryNode::ObjectFiles(CPP, &objects);
+  if (hidden_visibility_) {
+    WriteHiddenCompiles(out, &objects);
+  } else {
+    CCLibraryNode::ObjectFiles(CPP, &objects);
+  }
 
   set<string> flags;
   LinkFlags(CPP, &flags);
+  if (hidden_visibility_) {
+    flags.insert("$(SHARED_LIB_GC_ARGS)");
+  }
+
+  // Exported symbols, one (mangled) name or pattern per line, in the
+  // Darwin format: C symbols have a leading underscore. Elsewhere we turn
+  // them into a linker version script.
+  string exported_symbols, exported_symbols_prereqs;
+  if (!exported_symbols_.path().empty()) {
+    Resource version_script = VersionScript();
+    Makefile::Rule* script = out->StartRule(version_script.path(),
+                                            exported_symbols_.path());
+    script->WriteCommand("mkdir -p " + version_script.dirname());
+    script->WriteCommand(
+        "awk 'BEGIN { print \"{ global:\" } "
+        "/^[ \\t]*(#|$$)/ { next } "
+        "{ sub(/^_/, \"\", $$1); print \"  \" $$1 \";\" } "
+        "END { print \"  local: *;\"; print \"};\" }' " +
+        exported_symbols_.path() + " > " + version_script.path());
+    out->FinishRule(script);
+
+    exported_symbols = "$(call EXPORTED_SYMBOLS," +
+        exported_symbols_.path() + "," + version_script.path() + ")";
+    exported_symbols_prereqs = strings::JoinWith(" ",
+                                                 exported_symbols_.path(),
+                                                 version_script.path());
+  }
 
   // Link rule
   Resource file = OutLinkedObj();
-  Makefile::Rule* rule = out->StartRule(file.path(),
-                                        strings::JoinAll(objects.files(), " "));
+  Makefile::Rule* rule = out->StartRule(
+      file.path(),
+      strings::JoinWith(" ",
+                        strings::JoinAll(objects.files(), " "),
+                        exported_symbols_prereqs));
   rule->WriteUserEcho("Linking", file.path());
 
   // HACK(cvanarsdale):
@@ -126,15 +175,22 @@ void CCSharedLibraryNode::WriteLink(Makefile* out) const {
   // files to find unresolved symbols. We collect the dependencies
   // bottom up, so we push resources onto the front of the list so
   // unencumbered resources end up in the back of the list.
+  // Every object of our dependencies is part of the shared library, so
+  // their archives are linked whole.
   vector<Resource> copy = objects.files();
   std::reverse(copy.begin(), copy.end());
-  string obj_list = strings::JoinAll(copy, " ");
-  string exported_symbols;
-  if (!exported_symbols_.path().empty()) {
-    exported_symbols = strings::StringPrintf(
-        "$$($(EXPORTED_SYMBOLS) %s", exported_symbols_.path().c_str());
+  string obj_list;
+  for (const Resource& r : copy) {
+    obj_list += " ";
+    bool archive = r.has_tag("archive");
+    if (archive) {
+      obj_list += "$(LD_FORCE_LINK_START) ";
+    }
+    obj_list += r.path();
+    if (archive) {
+      obj_list += " $(LD_FORCE_LINK_END)";
+    }
   }
-
   rule->WriteCommand("mkdir -p " + file.dirname());
   rule->WriteCommand(strings::JoinWith(
       " ",
@@ -142,6 +198,14 @@ void CCSharedLibraryNode::WriteLink(Makefile* out) const {
       GetVariable("link_args").ref_name(),
       "-o", GetVariable("path").ref_name(),
       strings::JoinAll(flags, " ")));
+  if (hidden_visibility_ && !exported_symbols_.path().empty()) {
+    // A version script cannot export what was compiled hidden.
+    rule->WriteCommand("$(call CHECK_EXPORTED_SYMBOLS," +
+                       exported_symbols_.path() + "," +
+                       GetVariable("path").ref_name() + ") || "
+                       "{ rm -f " + GetVariable("path").ref_name() +
+                       "; exit 1; }");
+  }
   rule->WriteCommand("[ \"" + GetVariable("path").ref_name() + "\" = "
                      "\"" + file.path() + "\" ] || "
                      "ln -f -s " + GetVariable("basename").ref_name() + " " +
@@ -149,6 +213,36 @@ void CCSharedLibraryNode::WriteLink(Makefile* out) const {
   out->FinishRule(rule);
 }
 
+// "visibility": "hidden": we and every library we link are compiled again
+// under .gen-obj/hidden/<shared library>, so only symbols marked
+// __attribute__((visibility("default"))) are exported (and of those, only
+// the ones in exported_symbols_file, if given).
+void CCSharedLibraryNode::WriteHiddenCompiles(Makefile* out,
+                                              ResourceFileSet* objects) const {
+  string hidden_dir = strings::JoinPath(
+      strings::JoinPath(input().object_dir(), "hidden"),
+      target().make_path());
+  vector<Node*> all_deps;
+  CollectAllDependencies(OBJECT_FILES, CPP, &all_deps);
+  vector<const CCLibraryNode*> libraries;
+  for (const Node* node : all_deps) {
+    const CCLibraryNode* library = dynamic_cast<const CCLibraryNode*>(node);
+    if (library != NULL) {
+      libraries.push_back(library);
+    }
+  }
+  libraries.push_back(this);
+  for (const CCLibraryNode* library : libraries) {
+    library->WriteVariantCompiles(hidden_dir, kHiddenCompileArgs, "", out);
+    library->VariantObjectFiles(hidden_dir, objects);
+  }
+}
+
+Resource CCSharedLibraryNode::VersionScript() const {
+  return Resource::FromLocalPath(input().object_dir(),
+                                 target().make_path() + ".version_script");
+}
+
 void CCSharedLibraryNode::LocalWriteMakeInstall(Makefile* base,
                                                 Makefile::Rule* rule) const {
   set<string> dest_dirs;
@@ -228,6 +322,13 @@ void CCSharedLibraryNode::WriteMakeHead(const Input& input, Makefile* out) {
               ".dylib\"}'\n");
   out->append("\tSHARED_LIB_NAME:=awk '{print \"lib\"$$1\".dylib\"}'\n");
 
+  // $(call EXPORTED_SYMBOLS,<symbols file>,<version script>)
+  // $(call CHECK_EXPORTED_SYMBOLS,<symbols file>,<shared library>): ld64
+  // already fails on hidden exported symbols.
+  out->append("\tEXPORTED_SYMBOLS=-Wl,-exported_symbols_list,$(1)\n");
+  out->append("\tCHECK_EXPORTED_SYMBOLS=:\n");
+  out->append("\tSHARED_LIB_GC_ARGS:=-Wl,-dead_strip\n");
+
   out->append("else\n");
 
   // GCC
@@ -249,6 +350,20 @@ void CCSharedLibraryNode::WriteMakeHead(const Input& input, Makefile* out) {
   out->append("\tSHARED_LIB_NAME_MA:=awk '{print \"lib\"$$1\".so.\"$$2}'\n");
   out->append("\tSHARED_LIB_NAME:=awk '{print \"lib\"$$1\".so\"}'\n");
 
+  out->append("\tEXPORTED_SYMBOLS=-Wl,--version-script=$(2)\n");
+  // Fails if a symbol listed by name (not pattern) is not exported, i.e.
+  // its definition is hidden (or there is none).
+  out->append(
+      "\tCHECK_EXPORTED_SYMBOLS=nm -D --defined-only $(2) | awk '"
+      "FILENAME == ARGV[1] { "
+      "if (!/^[ \\t]*(\\#|$$)/ && $$1 !~ /[*?[]/) { "
+      "sub(/^_/, \"\", $$1); want[$$1] = 1 } next } "
+      "{ sub(/@.*/, \"\", $$3); delete want[$$3] } "
+      "END { for (s in want) { print ARGV[1] \": \" s \" is not exported: \" "
+      "\"mark its definition __attribute__((visibility(\\\"default\\\")))\" "
+      "> \"/dev/stderr\"; bad = 1 } exit bad }' $(1) -\n");
+  out->append("\tSHARED_LIB_GC_ARGS:=-Wl,--gc-sections -Wl,--hash-style=gnu\n");
+
   out->append("endif\n");
 }
 
@@ -17,7 +17,8 @@ class CCSharedLibraryNode : public CCLibraryNode {
   CCSharedLibraryNode(const TargetInfo& t,
                       const Input& i,
                       DistSource* s)
-      : CCLibraryNode(t, i, s) {
+      : CCLibraryNode(t, i, s),
+        hidden_visibility_(false) {
   }
   virtual ~CCSharedLibraryNode() {}
   virtual void Parse(BuildFile* file, const BuildFileNode& input);
@@ -31,7 +32,10 @@ class CCSharedLibraryNode : public CCLibraryNode {
 
  protected:
   Resource OutLinkedObj() const;
+  virtual bool ArchiveObjects() const { return false; }
   void WriteLink(Makefile* out) const;
+  void WriteHiddenCompiles(Makefile* out, ResourceFileSet* objects) const;
+  Resource VersionScript() const;
   void CreateBasename(const std::string& variable_name,
                       const std::string& variable_suffix);
   std::string DestInstallDir(const Resource& source) const;
@@ -39,6 +43,7 @@ class CCSharedLibraryNode : public CCLibraryNode {
   std::string major_version_, minor_version_, release_version_;
   std::string install_strip_prefix_;
   Resource exported_symbols_;
+  bool hidden_visibility_;
 };
 
 }  // namespace repobuild
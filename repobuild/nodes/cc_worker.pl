@@ -0,0 +1,377 @@
+#!/usr/bin/perl
+# Distributed c/c++ compiles for repobuild generated Makefiles.
+#
+#  cc_worker.pl serve [[address:]port] [slots]
+#    Compiles preprocessed sources sent by clients, at most <slots> at a
+#    time (default: the number of cpus). Listens on 127.0.0.1:8379 unless
+#    told otherwise. Workers need the same compilers as their clients, and
+#    should only listen on trusted networks. Clients must send the token in
+#    $CC_WORKER_TOKEN (a file, default ~/.config/repobuild/cc_worker.token,
+#    created if missing); copy it to every client. Only compile flags that
+#    cannot name a file or program are accepted (see SafeArg).
+#
+#  cc_worker.pl compile <compile command>
+#    Preprocesses locally, then compiles on one of $CC_WORKERS
+#    (host:port,host:port...). Runs <compile command> locally when no
+#    worker is reachable, when every worker stays busy for $CC_WORKER_WAIT
+#    seconds, when there is no readable $CC_WORKER_TOKEN, or when the command
+#    cannot be shipped (modules, clang time traces, split DWARF, flags
+#    workers refuse, ...). Debug info names the client's working directory,
+#    not the worker's.
+#
+# Protocol: every message is a list of fields, each "<length>\n<bytes>".
+#  request:  "repobuild-cc-3", <token>, <working dir>, <argc>, <args>...,
+#            <preprocessed source>
+#  response: "busy"
+#         or "done", <exit status>, <stderr>, <object file>
+
+use warnings;
+use strict;
+use Cwd qw(getcwd);
+use Fcntl;
+use File::Basename qw(dirname);
+use File::Path qw(make_path);
+use File::Temp qw(tempdir);
+use IO::Socket::INET;
+use POSIX ":sys_wait_h";
+
+my $kVersion = "repobuild-cc-3";
+my $kDefaultPort = 8379;
+
+# A worker that drops the connection (wrong token, or it exited) must send
+# us on to the next one, not kill us mid-write.
+$SIG{PIPE} = "IGNORE";
+
+sub WriteField {
+    my ($sock, $data) = @_;
+    print $sock length($data) . "\n" . $data;
+}
+
+sub ReadField {
+    my ($sock) = @_;
+    my $len = <$sock>;
+    return undef unless defined($len) && $len =~ /^(\d+)\n$/;
+    $len = $1;
+    my $data = "";
+    while (length($data) < $len) {
+        my $n = read($sock, $data, $len - length($data), length($data));
+        return undef unless $n;
+    }
+    return $data;
+}
+
+sub ReadFile {
+    my ($file) = @_;
+    local $/;
+    open(my $fh, "<", $file) || return "";
+    binmode($fh);
+    my $data = <$fh>;
+    close($fh);
+    return defined($data) ? $data : "";
+}
+
+sub WriteFile {
+    my ($file, $data) = @_;
+    open(my $fh, ">", $file) || die("$file: $!\n");
+    binmode($fh);
+    print $fh $data;
+    close($fh);
+}
+
+# Runs a command, with its stdout and stderr going to $log if given.
+sub Run {
+    my ($log, @command) = @_;
+    my $pid = fork();
+    die("fork: $!\n") unless defined($pid);
+    if ($pid == 0) {
+        if (defined($log)) {
+            open(STDOUT, ">", $log) || exit(127);
+            open(STDERR, ">&", \*STDOUT) || exit(127);
+        }
+        exec(@command) || exit(127);
+    }
+    waitpid($pid, 0);
+    return ($? & 127) ? 1 : ($? >> 8);
+}
+
+sub TokenFile {
+    return $ENV{CC_WORKER_TOKEN} ||
+        ($ENV{HOME} || "") . "/.config/repobuild/cc_worker.token";
+}
+
+# Returns the shared secret, or undef if the token file is missing, bad, or
+# readable by anyone but its owner.
+sub ReadToken {
+    my $file = TokenFile();
+    my @stat = stat($file);
+    return undef unless @stat && ($stat[2] & 077) == 0;
+    my $token = ReadFile($file);
+    return ($token =~ /^(\w{32,})\n?$/) ? $1 : undef;
+}
+
+# Creates a random token file, readable only by us, unless there is one.
+sub CreateToken {
+    my $file = TokenFile();
+    return if -e $file;
+    make_path(dirname($file), { mode => 0700 });
+    open(my $random, "<", "/dev/urandom") || die("/dev/urandom: $!\n");
+    read($random, my $bytes, 16) == 16 || die("/dev/urandom: short read\n");
+    close($random);
+    sysopen(my $fh, $file, O_WRONLY | O_CREAT | O_EXCL, 0600) ||
+        die("$file: $!\n");
+    print $fh unpack("H*", $bytes) . "\n";
+    close($fh);
+}
+
+sub NumCpus {
+    my $cpus = `getconf _NPROCESSORS_ONLN 2>/dev/null`;
+    return ($cpus && $cpus =~ /^(\d+)/) ? $1 : 1;
+}
+
+###########
+# Worker. #
+###########
+
+# Whether a worker may pass a compile flag on: only flags that cannot name
+# a file to read or write, or a program to run. -f, -g, -m, -O and -W
+# values may not contain "/" or ",", which keeps out -fdump-*=<path>,
+# -fprofile-*=<path>, -Wa,<flags> and the like; -I, -isystem, -D and -U
+# only matter to preprocessing, which clients have already done.
+sub SafeArg {
+    my ($arg) = @_;
+    return 0 if $arg =~ /^-(fplugin|fmodule|fmodules|mllvm)\b/;
+    return $arg =~ /^-(c|w|pipe|pthread|pedantic|pedantic-errors)$/ ||
+        $arg =~ /^-[fgmOW][\w.+=-]*$/ ||
+        $arg =~ /^-std(lib)?=[\w+]+$/ ||
+        $arg =~ /^-(D\w+(=.*)?|U\w+|I.+|isystem.+)$/s ||
+        $arg eq "-Qunused-arguments";
+}
+
+# Whether a client's compile is one a worker runs: a known compiler, flags
+# SafeArg allows, and the "-x <preprocessed c or c++>" clients add.
+sub SafeArgs {
+    my (@args) = @_;
+    return 0 unless @args && $args[0] =~
+        /^(cc|c\+\+|gcc|g\+\+|clang|clang\+\+)(-[\d.]+)?$/;
+    for (my $i = 1; $i < @args; ++$i) {
+        if ($args[$i] eq "-x") {
+            return 0 unless ($args[++$i] || "") =~ /^(c\+\+-)?cpp-output$/;
+        } elsif (!SafeArg($args[$i])) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+# Assembler directives that read files: the source could name ours.
+sub SafeSource {
+    my ($source) = @_;
+    return $source !~ /\.(incbin|include)\b/;
+}
+
+sub HandleCompile {
+    my ($client, $token) = @_;
+    binmode($client);
+    my $version = ReadField($client);
+    return unless defined($version) && $version eq $kVersion;
+    my $client_token = ReadField($client);
+    return unless defined($client_token) && $client_token eq $token;
+    my $client_dir = ReadField($client);
+    return unless defined($client_dir) && $client_dir =~ m{^/};
+    my $argc = ReadField($client);
+    return unless defined($argc) && $argc =~ /^\d+$/;
+    my @args;
+    for (1..$argc) {
+        my $arg = ReadField($client);
+        return unless defined($arg);
+        push(@args, $arg);
+    }
+    my $source = ReadField($client);
+    return unless defined($source);
+
+    # We compile in a temporary directory, which debug info calls the
+    # client's directory instead.
+    my $dir = tempdir("cc_worker.XXXXXX", TMPDIR => 1, CLEANUP => 1);
+    chdir($dir) || return;
+    my $status = 127;
+    if (SafeArgs(@args) && SafeSource($source)) {
+        WriteFile("$dir/input", $source);
+        $status = Run("$dir/stderr", @args,
+                      "-fdebug-prefix-map=$dir=$client_dir",
+                      "$dir/input", "-o", "$dir/output");
+    } else {
+        WriteFile("$dir/stderr", "cc_worker: refusing to run: @args\n");
+    }
+    WriteField($client, "done");
+    WriteField($client, $status);
+    WriteField($client, ReadFile("$dir/stderr"));
+    WriteField($client, $status == 0 ? ReadFile("$dir/output") : "");
+    close($client);
+}
+
+sub Serve {
+    my ($address, $slots) = @_;
+    $address = $kDefaultPort unless defined($address);
+    $address = "127.0.0.1:$address" unless $address =~ /:/;
+    $slots = NumCpus() unless $slots;
+    CreateToken();
+    my $token = ReadToken() ||
+        die("cc_worker: " . TokenFile() . " must hold a token and be " .
+            "readable only by its owner\n");
+    my $server = IO::Socket::INET->new(LocalAddr => $address,
+                                       Listen => 128,
+                                       ReuseAddr => 1,
+                                       Proto => "tcp")
+        || die("cc_worker: cannot listen on $address: $@\n");
+    print STDERR "cc_worker: serving on $address, $slots slots\n";
+
+    my %children;
+    while (1) {
+        my $client = $server->accept() || next;
+        while ((my $pid = waitpid(-1, WNOHANG)) > 0) {
+            delete($children{$pid});
+        }
+        my $pid = (scalar(keys(%children)) < $slots) ? fork() : undef;
+        if (!defined($pid)) {
+            WriteField($client, "busy");
+        } elsif ($pid == 0) {
+            close($server);
+            HandleCompile($client, $token);
+            exit(0);
+        } else {
+            $children{$pid} = 1;
+        }
+        close($client);
+    }
+}
+
+###########
+# Client. #
+###########
+
+# Splits a compile command into the local preprocessing command and the
+# remote compile arguments, or returns nothing if it has to run locally.
+sub PlanCompile {
+    my (@command) = @_;
+    my ($output, $source, $compile, $depfile, $target);
+    my @preprocess = ($command[0]);
+    my @remote = ($command[0]);
+    for (my $i = 1; $i < @command; ++$i) {
+        my $arg = $command[$i];
+        # Split DWARF would leave the .dwo on the worker.
+        if ($arg =~ /^(-fmodule|-fmodules|-ftime-trace|-gsplit-dwarf|--precompile|-x$|-E$|-S$|-MM?$|@)/) {
+            return;
+        } elsif ($arg eq "-c") {
+            $compile = 1;
+            push(@preprocess, "-E");
+            push(@remote, $arg);
+        } elsif ($arg eq "-o") {
+            $output = $command[++$i];
+        } elsif ($arg =~ /^-(MF|MT|MQ|I|D|U|isystem|iquote|idirafter|include|imacros)$/) {
+            $target = 1 if $arg =~ /^-M[TQ]$/;
+            push(@preprocess, $arg, $command[++$i]);
+        } elsif ($arg =~ /^-(MMD|MD|MP|I|D|U|isystem|iquote|idirafter)/) {
+            $depfile = 1 if $arg =~ /^-MM?D$/;
+            push(@preprocess, $arg);
+        } elsif ($arg =~ /^[^-].*\.(c|cc|cpp|cxx)$/) {
+            return if defined($source);
+            $source = $arg;
+            push(@preprocess, $arg);
+        } else {
+            return unless SafeArg($arg);
+            push(@preprocess, $arg);
+            push(@remote, $arg);
+        }
+    }
+    return unless $compile && defined($output) && defined($source);
+
+    my $preprocessed = "$output.cc_worker.i";
+    push(@preprocess, "-o", $preprocessed);
+    push(@preprocess, "-MT", $output) if $depfile && !$target;
+    push(@remote, "-x", $source =~ /\.c$/ ? "cpp-output" : "c++-cpp-output");
+    return ($output, $preprocessed, \@preprocess, \@remote);
+}
+
+# Returns undef if the worker is unreachable, "busy" if it is full, or
+# [status, stderr, object].
+sub TryWorker {
+    my ($worker, $token, $remote, $source) = @_;
+    my $sock = IO::Socket::INET->new(PeerAddr => $worker,
+                                     Proto => "tcp",
+                                     Timeout => 2) || return undef;
+    binmode($sock);
+    WriteField($sock, $kVersion);
+    WriteField($sock, $token);
+    WriteField($sock, getcwd());
+    WriteField($sock, scalar(@$remote));
+    WriteField($sock, $_) for @$remote;
+    WriteField($sock, $source);
+    $sock->flush();
+    my $reply = ReadField($sock);
+    return undef unless defined($reply);
+    return "busy" if $reply eq "busy";
+    my @result = (ReadField($sock), ReadField($sock), ReadField($sock));
+    return undef if grep { !defined($_) } @result;
+    return \@result;
+}
+
+sub Compile {
+    my (@command) = @_;
+    my @workers = grep { $_ ne "" } split(/[,\s]+/, $ENV{CC_WORKERS} || "");
+    my $token = @workers ? ReadToken() : undef;
+    my ($output, $preprocessed, $preprocess, $remote) = PlanCompile(@command);
+    return Run(undef, @command)
+        unless @workers && defined($token) && defined($output);
+
+    # Preprocessing errors are compile errors, report them as such.
+    my $status = Run(undef, @$preprocess);
+    if ($status != 0) {
+        unlink($preprocessed);
+        return $status;
+    }
+    my $source = ReadFile($preprocessed);
+    unlink($preprocessed);
+
+    # Workers do not have the files cc_embed_data pulls in with .incbin, and
+    # refuse to read theirs.
+    return Run(undef, @command) unless SafeSource($source);
+
+    # Spread outputs over workers. While any worker is up but busy, wait
+    # for a free slot: make -j can run more compiles than we have cpus.
+    my $first = unpack("%32C*", $output) % scalar(@workers);
+    @workers = (@workers[$first..$#workers], @workers[0..$first - 1]);
+    my $deadline = time() + (defined($ENV{CC_WORKER_WAIT}) ?
+                             $ENV{CC_WORKER_WAIT} : 10);
+    while (1) {
+        my $busy = 0;
+        for my $worker (@workers) {
+            my $result = TryWorker($worker, $token, $remote, $source);
+            next unless defined($result);
+            if (!ref($result)) {
+                $busy = 1;
+                next;
+            }
+            my ($remote_status, $stderr, $object) = @$result;
+            next if $remote_status == 127;  # no such compiler, or refused.
+            print STDERR $stderr;
+            WriteFile($output, $object) if $remote_status == 0;
+            print STDERR "cc_worker: $output on $worker\n"
+                if $ENV{CC_WORKER_VERBOSE};
+            return $remote_status;
+        }
+        last unless $busy && time() < $deadline;
+        select(undef, undef, undef, 0.1 + rand(0.2));
+    }
+    print STDERR "cc_worker: $output locally\n" if $ENV{CC_WORKER_VERBOSE};
+    return Run(undef, @command);
+}
+
+my $mode = shift(@ARGV) || "";
+if ($mode eq "serve") {
+    Serve(@ARGV);
+} elsif ($mode eq "compile" && @ARGV) {
+    exit(Compile(@ARGV));
+} else {
+    die("usage: $0 serve [[address:]port] [slots]\n" .
+        "       $0 compile <compile command>\n");
+}
@@ -12,6 +12,7 @@
 #include "repobuild/nodes/cmake.h"
 #include "repobuild/nodes/gen_sh.h"
 #include "repobuild/nodes/make.h"
+#include "repobuild/nodes/makefile.h"
 #include "repobuild/reader/buildfile.h"
 
 using std::map;
@@ -29,15 +30,15 @@ void CmakeNode::Parse(BuildFile* file, const BuildFileNode& input) {
   if (cmake_dir.empty()) {
     cmake_dir = target().dir();
   }
-  cmake_dir = strings::JoinPath("$ROOT_DIR", cmake_dir);
+  cmake_dir = strings::JoinPath("$(ROOT_DIR)", cmake_dir);
 
   // configure_env
   vector<string> cmake_envs;
-  current_reader()->ParseRepeatedString("cmake_env", &cmake_envs);
+  current_reader()->ParseRepeatedMakeString("cmake_env", false, &cmake_envs);
 
   // cmake_args
   vector<string> cmake_args;
-  current_reader()->ParseRepeatedString("cmake_args", true, &cmake_args);
+  current_reader()->ParseRepeatedMakeString("cmake_args", true, &cmake_args);
 
   // Generate the output files.
   GenShNode* gen = NewSubNodeWithCurrentDeps<GenShNode>(file);
@@ -52,18 +53,18 @@ void CmakeNode::Parse(BuildFile* file, const BuildFileNode& input) {
     user_env.append("; ");
   }
 
-  // Actual cmake command  ------
+  // Actual cmake command (makefile text) ------
   string build_setup =
-      "BASE=" + cmake_dir + "; "
-      "DEST_DIR=$GEN_DIR; "
-      "mkdir -p $DEST_DIR/build; "
-      "STAGING=$DEST_DIR/.staging; "
-      "cd $GEN_DIR/build";
-  string build_env = user_env +"CC=$CC CXX=$CXX ";
-  string cmake_cmd =
+      "BASE=" + cmake_dir + "; " +
+      Makefile::Escape("DEST_DIR=$GEN_DIR; "
+                       "mkdir -p $DEST_DIR/build; "
+                       "STAGING=$DEST_DIR/.staging; "
+                       "cd $GEN_DIR/build");
+  string build_env = user_env + Makefile::Escape("CC=$CC CXX=$CXX ");
+  string cmake_cmd = Makefile::Escape(
       "cmake -DCMAKE_INSTALL_PREFIX=. -B . $BASE "
       "-DCMAKE_CXX_FLAGS=\"$BASIC_CXXFLAGS $USER_CXXFLAGS\" "
-      "-DCMAKE_C_FLAGS=\"$BASIC_CFLAGS $USER_CFLAGS\"";
+      "-DCMAKE_C_FLAGS=\"$BASIC_CFLAGS $USER_CFLAGS\"");
   for (const string& it : cmake_args) {
     cmake_cmd.append(" " + it);
   }
@@ -75,18 +76,18 @@ void CmakeNode::Parse(BuildFile* file, const BuildFileNode& input) {
 
   // Make output --------------------------
   string preinstall_cmd = build_setup;
-  string postinstall_cmd =
+  string postinstall_cmd = Makefile::Escape(
       "(if [ -d \"$STAGING/$BASE\" ]; then"
       " (for f in $(ls -d $STAGING/$BASE/*); do"
       "  rm -rf $DEST_DIR/$(basename \"$f\"); mv $f $DEST_DIR || exit 1;"
       " done) &&"
       " rm -rf $STAGING; else echo -n ''; "
-      "fi)";
+      "fi)");
   MakeNode* make = NewSubNode<MakeNode>(file);
   make->AddDependencyTarget(gen->target());
   make->ParseWithOptions(file, input,
                          preinstall_cmd,
-                         "$STAGING",
+                         Makefile::Escape("$STAGING"),
                          postinstall_cmd);
 }
 
@@ -1,27 +1,55 @@
 // Copyright 2013
 // Author: Christopher Van Arsdale
 
+#include <memory>
 #include <set>
 #include <string>
 #include <vector>
+#include "common/base/flags.h"
+#include "common/log/log.h"
+#include "common/strings/path.h"
+#include "common/strings/strutil.h"
 #include "repobuild/env/input.h"
 #include "repobuild/env/resource.h"
 #include "repobuild/nodes/execute_test.h"
 #include "repobuild/nodes/gen_sh.h"
+#include "repobuild/reader/buildfile.h"
+
+DEFINE_string(test_cache_dir, "",
+              "Default for the TEST_CACHE_DIR make variable, where passing "
+              "test results are cached (e.g. $(HOME)/.cache/repobuild/tests). "
+              "Empty, the default, runs every test every time.");
+DEFINE_string(test_history, "$(HOME)/.cache/repobuild/test-history",
+              "Default for the TEST_HISTORY make variable, where the last few "
+              "run times of each test are recorded (relative to the root "
+              "unless absolute). \"make tests\" starts the longest tests "
+              "first. The default outlives \"make clean\" and checkouts, "
+              "like TEST_CACHE_DIR. Empty disables.");
 
 using std::set;
 using std::string;
 using std::vector;
 
 namespace repobuild {
-  
+namespace {
+Resource ShardScript(const Input& input) {
+  return Resource::FromLocalPath(input.genfile_dir(), "test_shards.sh");
+}
+Resource CacheScript(const Input& input) {
+  return Resource::FromLocalPath(input.genfile_dir(), "test_cache.sh");
+}
+}
+
 ExecuteTestNode::ExecuteTestNode(const TargetInfo& target,
                                  const Input& input,
                                  DistSource* source)
     : Node(target.GetParallelTarget(target.local_path() + ".test"),
            input,
            source),
-      orig_target_(target) {
+      orig_target_(target),
+      shard_count_(1),
+      shardable_(false),
+      default_test_seconds_(0) {
 }
 
 ExecuteTestNode::~ExecuteTestNode() {
@@ -36,6 +64,21 @@ void ExecuteTestNode::LocalTests(LanguageType lang,
   targets->insert(target().make_path());
 }
 
+void ExecuteTestNode::ParseTestOptions(const BuildFileNode& input) {
+  std::unique_ptr<BuildFileNodeReader> reader(NewBuildReader(input));
+  reader->ParseRepeatedFiles("data", &data_);
+  reader->ParseIntField("shard_count", &shard_count_);
+  if (shard_count_ < 1) {
+    LOG(FATAL) << "shard_count must be >= 1 in " << target().full_path();
+  }
+  // Sharding is the test main's job (GTEST_SHARD_INDEX); python and java
+  // test mains would each run every test.
+  if (shard_count_ > 1 && !shardable_) {
+    LOG(FATAL) << "shard_count is only supported by cc_test (gtest), in "
+               << target().full_path();
+  }
+}
+
 void ExecuteTestNode::AddShNodes(BuildFile* file, Node* binary_node) {
   ResourceFileSet binaries;
   binary_node->TopTestBinaries(Node::NO_LANG, &binaries);
@@ -46,12 +89,32 @@ void ExecuteTestNode::AddShNodes(BuildFile* file, Node* binary_node) {
     node->SetMakeTarget(r.path());
 
     vector<Resource> inputs(1, r), outputs;
-    string cmd;
+    inputs.insert(inputs.end(), data_.begin(), data_.end());
+    string cmd;  // makefile text: our paths are under $(OBJ_DIR).
     if (r.path()[0] == '/') {
       cmd = r.path();
     } else {
-      cmd = "$ROOT_DIR/" + r.path();
+      cmd = "$(ROOT_DIR)/" + r.path();
+    }
+    if (shard_count_ > 1) {
+      // Shard logs go next to the binary, e.g. .gen-obj/a/b_test.<i>.log.
+      inputs.push_back(ShardScript(input()));
+      cmd = strings::JoinWith(
+          " ",
+          "$(ROOT_DIR)/" + ShardScript(input()).path(),
+          strings::StringPrintf("%d", shard_count_),
+          "$(ROOT_DIR)/" + strings::JoinPath(ObjectDir(), r.basename()),
+          cmd);
     }
+
+    // Passing results are reused while the binaries (e.g. a java_binary's
+    // script and jar) and data are unchanged.
+    vector<Resource> key_files(binaries.files());
+    key_files.insert(key_files.end(), data_.begin(), data_.end());
+    inputs.push_back(CacheScript(input()));
+    node->SetResultCache(CacheScript(input()), key_files,
+                         target().make_path());
+
     node->Set(cmd,  // binary target.
               "",  // clean command
               inputs,
@@ -60,4 +123,165 @@ void ExecuteTestNode::AddShNodes(BuildFile* file, Node* binary_node) {
   }
 }
 
+// static
+void ExecuteTestNode::WriteMakeHead(const Input& input, Makefile* out) {
+  const char kShardScript[] =
+    "#!/bin/bash\n"
+    "# test_shards.sh <shard count> <log prefix> <test command...>\n"
+    "# Runs a test command once per shard, $TEST_JOBS (default: the number\n"
+    "# of cpus) shards at a time. Shard <i> gets GTEST_TOTAL_SHARDS=<count>\n"
+    "# and GTEST_SHARD_INDEX=<i>, also as TEST_TOTAL_SHARDS/TEST_SHARD_INDEX\n"
+    "# for other test mains. Its output goes to <log prefix>.<i>.log.\n"
+    "if [ \"$1\" = \"--shard\" ]; then\n"
+    "  INDEX=\"$2\"\n"
+    "  SHARDS=\"$3\"\n"
+    "  LOG=\"$4.$INDEX\"\n"
+    "  shift 4\n"
+    "  rm -f \"$LOG.sharded\"\n"
+    "  export GTEST_TOTAL_SHARDS=\"$SHARDS\" GTEST_SHARD_INDEX=\"$INDEX\"\n"
+    "  export TEST_TOTAL_SHARDS=\"$SHARDS\" TEST_SHARD_INDEX=\"$INDEX\"\n"
+    "  export GTEST_SHARD_STATUS_FILE=\"$LOG.sharded\"\n"
+    "  export TEST_SHARD_STATUS_FILE=\"$LOG.sharded\"\n"
+    "  SECONDS=0\n"
+    "  \"$@\" > \"$LOG.log\" 2>&1\n"
+    "  echo \"$? $SECONDS\" > \"$LOG.status\"\n"
+    "  exit 0\n"
+    "fi\n"
+    "\n"
+    "SHARDS=\"$1\"\n"
+    "LOG=\"$2\"\n"
+    "shift 2\n"
+    "CPUS=\"$(getconf _NPROCESSORS_ONLN 2>/dev/null || echo 1)\"\n"
+    "JOBS=\"${TEST_JOBS:-$CPUS}\"\n"
+    "mkdir -p \"$(dirname \"$LOG\")\"\n"
+    "rm -f \"$LOG\".*.status\n"
+    "I=0\n"
+    "while [ $I -lt $SHARDS ]; do\n"
+    "  echo $I\n"
+    "  I=$((I + 1))\n"
+    "done | xargs -P \"$JOBS\" -I{} \\\n"
+    "    \"$0\" --shard {} \"$SHARDS\" \"$LOG\" \"$@\"\n"
+    "\n"
+    "FAILED=0\n"
+    "UNSHARDED=0\n"
+    "I=0\n"
+    "while [ $I -lt $SHARDS ]; do\n"
+    "  read STATUS TIME < \"$LOG.$I.status\" 2>/dev/null || STATUS=\"?\"\n"
+    "  if [ \"$STATUS\" = \"0\" ]; then\n"
+    "    echo \"Shard $I/$SHARDS passed (${TIME}s)\"\n"
+    "    [ -f \"$LOG.$I.sharded\" ] || UNSHARDED=1\n"
+    "  else\n"
+    "    echo \"Shard $I/$SHARDS FAILED (exit $STATUS, ${TIME}s):\"\n"
+    "    cat \"$LOG.$I.log\" 2>/dev/null\n"
+    "    FAILED=$((FAILED + 1))\n"
+    "  fi\n"
+    "  I=$((I + 1))\n"
+    "done\n"
+    "if [ $UNSHARDED -ne 0 ]; then\n"
+    "  echo \"Warning: $1 is not sharded, every shard ran every test.\"\n"
+    "fi\n"
+    "if [ $FAILED -ne 0 ]; then\n"
+    "  echo \"$FAILED of $SHARDS shards failed: $*\"\n"
+    "  exit 1\n"
+    "fi\n";
+  out->GenerateExecFile("TestShards", ShardScript(input).path(),
+                        kShardScript);
+
+  const char kCacheScript[] =
+    "#!/bin/bash\n"
+    "# test_cache.sh <test> <env names> <files...> -- <test command...>\n"
+    "# Runs a test command, unless it already passed with the same command,\n"
+    "# environment variables (comma separated names) and file contents.\n"
+    "# Passes are recorded, with their output, under $TEST_CACHE_DIR.\n"
+    "# Failures are not, so they always run again. Paths are hashed relative\n"
+    "# to $ROOT_DIR, so other checkouts of the tree share results.\n"
+    "# Run times of <test>, in seconds, go to $TEST_HISTORY/<test>.\n"
+    "TEST=\"$1\"\n"
+    "NAMES=\"$2\"\n"
+    "shift 2\n"
+    "FILES=()\n"
+    "while [ $# -gt 0 ] && [ \"$1\" != \"--\" ]; do\n"
+    "  FILES+=(\"$1\")\n"
+    "  shift\n"
+    "done\n"
+    "shift\n"
+    "\n"
+    "Run() {\n"
+    "  SECONDS=0\n"
+    "  \"$@\"\n"
+    "  local STATUS=$?\n"
+    "  if [ -n \"$TEST_HISTORY\" ]; then\n"
+    "    local HISTORY=\"$TEST_HISTORY/$TEST\"\n"
+    "    { mkdir -p \"$(dirname \"$HISTORY\")\" &&\n"
+    "      (tail -n 4 \"$HISTORY\"; echo $SECONDS) > \"$HISTORY.$$\" &&\n"
+    "      mv -f \"$HISTORY.$$\" \"$HISTORY\"; } 2>/dev/null\n"
+    "  fi\n"
+    "  return $STATUS\n"
+    "}\n"
+    "\n"
+    "if [ -z \"$TEST_CACHE_DIR\" ]; then\n"
+    "  Run \"$@\"\n"
+    "  exit $?\n"
+    "fi\n"
+    "\n"
+    "if command -v sha256sum > /dev/null; then\n"
+    "  SUM=\"sha256sum\"\n"
+    "else\n"
+    "  SUM=\"shasum -a 256\"\n"
+    "fi\n"
+    "KEY=$( (\n"
+    "  echo \"repobuild-test-cache-1\"\n"
+    "  for ARG in \"$@\"; do\n"
+    "    echo \"arg ${ARG//$ROOT_DIR/}\"\n"
+    "  done\n"
+    "  for NAME in ${NAMES//,/ }; do\n"
+    "    VALUE=\"${!NAME}\"\n"
+    "    echo \"env $NAME=${VALUE//$ROOT_DIR/}\"\n"
+    "  done\n"
+    "  for FILE in \"${FILES[@]}\"; do\n"
+    "    echo \"file ${FILE//$ROOT_DIR/} $($SUM < \"$FILE\")\"\n"
+    "  done\n"
+    ") | $SUM | cut -d' ' -f1)\n"
+    "\n"
+    "RESULT=\"$TEST_CACHE_DIR/${KEY:0:2}/$KEY\"\n"
+    "if [ -f \"$RESULT\" ]; then\n"
+    "  echo \"Cached pass: $RESULT\"\n"
+    "  cat \"$RESULT\"\n"
+    "  exit 0\n"
+    "fi\n"
+    "mkdir -p \"$(dirname \"$RESULT\")\"\n"
+    "Run \"$@\" > \"$RESULT.$$\" 2>&1\n"
+    "STATUS=$?\n"
+    "cat \"$RESULT.$$\"\n"
+    "if [ $STATUS -eq 0 ]; then\n"
+    "  mv -f \"$RESULT.$$\" \"$RESULT\"\n"
+    "else\n"
+    "  rm -f \"$RESULT.$$\"\n"
+    "fi\n"
+    "exit $STATUS\n";
+  out->GenerateExecFile("TestCache", CacheScript(input).path(),
+                        kCacheScript);
+  out->append("TEST_CACHE_DIR ?= " + FLAGS_test_cache_dir + "\n");
+  const string& history = FLAGS_test_history;
+  out->append("TEST_HISTORY ?= " +
+              (history.empty() || history[0] == '/' || history[0] == '$' ?
+               history : "$(ROOT_DIR)/" + history) + "\n");
+
+  // TEST_SECONDS lists "<seconds>:<test>" for each test, with its type's
+  // default time. TESTS_LONGEST_FIRST orders them by the slowest of their
+  // recorded runs, or that default, when make reads the tests rule, so
+  // new history counts without rerunning repobuild.
+  out->append(
+      "TESTS_LONGEST_FIRST = $(shell awk -v dir=\"$(TEST_HISTORY)\" '"
+      "BEGIN { for (i = 1; i < ARGC; i++) {"
+      " n = index(ARGV[i], \":\"); t = substr(ARGV[i], n + 1);"
+      " s = substr(ARGV[i], 1, n - 1) + 0; best = -1;"
+      " if (dir != \"\") {"
+      " f = dir \"/\" t;"
+      " while ((getline line < f) > 0) if (line + 0 > best) best = line + 0;"
+      " close(f) }"
+      " print (best < 0 ? s : best), t } }' $(TEST_SECONDS) | "
+      "sort -s -k1,1nr | cut -d' ' -f2)\n\n");
+}
+
 }  // namespace repobuild
@@ -13,6 +13,12 @@
 
 namespace repobuild {
 
+// Expected run time, in seconds, of tests with no recorded history. Small
+// java tests are mostly JVM startup.
+const int kCCTestSeconds = 2;
+const int kPyTestSeconds = 5;
+const int kJavaTestSeconds = 10;
+
 class ExecuteTestNode : public Node {
  public:
   ExecuteTestNode(const TargetInfo& target,
@@ -25,20 +31,36 @@ class ExecuteTestNode : public Node {
   virtual void LocalWriteMake(Makefile* out) const;
   virtual void LocalTests(LanguageType lang,
                           std::set<std::string>* targets) const;
+  virtual int DefaultTestSeconds() const { return default_test_seconds_; }
+
+  // The shard runner and result cache, shared by every kind of test.
+  static void WriteMakeHead(const Input& input, Makefile* out);
 
  protected:
+  // "shard_count": if > 1, the test binary is run that many times in
+  // parallel, each running a share of its tests (gtest sharding). Only
+  // tests that shard themselves (cc_test) accept it.
+  // "data": files the test reads, which rerun it (and key its cached
+  // result, with the binary) when they change.
+  void ParseTestOptions(const BuildFileNode& input);
   void AddShNodes(BuildFile* file, Node* binary_node);
 
   TargetInfo orig_target_;
+  int shard_count_;
+  bool shardable_;
+  std::vector<Resource> data_;
+  int default_test_seconds_;
 };
 
-template <class T>
+template <class T, int kDefaultTestSeconds, bool kShardable = false>
 class ExecuteTestNodeImpl : public ExecuteTestNode {
  public:
   ExecuteTestNodeImpl(const TargetInfo& target,
                       const Input& input,
                       DistSource* source)
       : ExecuteTestNode(target, input, source) {
+    default_test_seconds_ = kDefaultTestSeconds;
+    shardable_ = kShardable;
   }
   virtual ~ExecuteTestNodeImpl() {}
 
@@ -49,6 +71,7 @@ class ExecuteTestNodeImpl : public ExecuteTestNode {
     AddSubNode(subnode);
 
     // test node.
+    ParseTestOptions(input);
     AddShNodes(file, subnode);
   }
 };
@@ -27,15 +27,23 @@ using std::set;
 namespace repobuild {
 namespace {
 const char kRootDir[] = "ROOT_DIR";
+
+string JoinRoot(const string& path) {
+  return strings::JoinPath("$(" + string(kRootDir) + ")/", path);
+}
 }
 
 void GenShNode::Parse(BuildFile* file, const BuildFileNode& input) {
   Node::Parse(file, input);
-  if (!current_reader()->ParseStringField("build_cmd", cd_, &build_cmd_) &&
-      !current_reader()->ParseStringField("cmd", cd_, &build_cmd_)) {
+
+  // $ROOT_DIR is also a make variable, with the same value.
+  current_reader()->SetReplaceVariable(false, kRootDir, "$(ROOT_DIR)");
+  current_reader()->SetReplaceVariable(true, kRootDir, "$(ROOT_DIR)");
+  if (!current_reader()->ParseMakeStringField("build_cmd", cd_, &build_cmd_) &&
+      !current_reader()->ParseMakeStringField("cmd", cd_, &build_cmd_)) {
     LOG(FATAL) << "Could not parse build_cmd/cmd.";
   }
-  current_reader()->ParseStringField("clean", false, &clean_cmd_);
+  current_reader()->ParseMakeStringField("clean", false, &clean_cmd_);
   current_reader()->ParseRepeatedFiles("input_files", &input_files_);
   current_reader()->ParseRepeatedFiles("outs", false, &outputs_);
 }
@@ -100,10 +108,37 @@ void GenShNode::LocalWriteMake(Makefile* out) const {
       env_vars[it.first] = it.second;
     }
 
-    // Now write the actual comment.
-    // This is a hack for now.
-    string command = strings::ReplaceAll(
-        build_cmd_, "$(ROOT_DIR)", "$ROOT_DIR");
+    string command = build_cmd_;
+
+    // Cached results, keyed by the command, our environment variables and
+    // the contents of cache_key_files_. Runs that miss are timed.
+    if (!cache_script_.path().empty()) {
+      vector<string> env_names, key_files;
+      for (const auto& it : env_vars) {
+        env_names.push_back(it.first);
+      }
+      for (const Resource& r : cache_key_files_) {
+        key_files.push_back(r.path()[0] == '/' ? r.path() :
+                            JoinRoot(r.path()));
+      }
+      // Our variables are only set for the shell running the command: the
+      // script needs them in its environment.
+      vector<string> exports = env_names;
+      exports.push_back(kRootDir);
+      exports.push_back("TEST_CACHE_DIR");
+      exports.push_back("TEST_HISTORY");
+      command = strings::JoinWith(
+          " ",
+          "export " + strings::JoinAll(exports, " ") + ";",
+          JoinRoot(cache_script_.path()),
+          cache_history_name_,
+          "\"" + strings::JoinAll(env_names, ",") + "\"",
+          strings::JoinAll(key_files, " "),
+          "--",
+          command);
+      prefix += " TEST_CACHE_DIR=\"$(TEST_CACHE_DIR)\"";
+      prefix += " TEST_HISTORY=\"$(TEST_HISTORY)\"";
+    }
     rule->WriteCommand(WriteCommand(env_vars, prefix, command, touch_cmd));
   }
   out->FinishRule(rule);
@@ -137,9 +172,6 @@ void AddEnvVar(const string& var, string* out) {
   out->append(var);
   out->append(")\"");
 }
-string JoinRoot(const string& path) {
-  return strings::JoinPath("$(" + string(kRootDir) + ")/", path);
-}
 }
 
 string GenShNode::WriteCommand(const map<string, string>& env_vars,
@@ -184,11 +216,7 @@ string GenShNode::WriteCommand(const map<string, string>& env_vars,
 
   // Execute command
   out.append(" eval '(");
-  if (escape_command_) {
-    out.append(Makefile::Escape(cmd));
-  } else {
-    out.append(cmd);
-  }
+  out.append(cmd);
   out.append(")'");
 
   // Logfile, if any
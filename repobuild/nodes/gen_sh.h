@@ -20,14 +20,14 @@ class GenShNode : public Node {
       : Node(t, i, s),
         cd_(true),
         make_name_("Script"),
-        make_target_(t.full_path()),
-        escape_command_(true) {
+        make_target_(t.full_path()) {
   }
   virtual ~GenShNode() {}
   virtual std::string Name() const { return "gen_sh"; }
   virtual void Parse(BuildFile* file, const BuildFileNode& input);
 
-  // Alternative to parse
+  // Alternative to parse. The commands are makefile text: escape anything
+  // that is not a make reference (see Makefile::Escape).
   void Set(const std::string& build_cmd,
            const std::string& clean_cmd,
            const std::vector<Resource>& input_files,
@@ -38,7 +38,17 @@ class GenShNode : public Node {
   void AddLocalEnvVariable(const std::string& var, const std::string& val) {
     local_env_vars_[var] = val;
   }
-  void SetMakefileEscape(bool escape) { escape_command_ = escape; }
+
+  // Runs our command through cache_script (test_cache.sh), which skips it
+  // if it already passed with the same key_files, command and environment,
+  // and otherwise records how long it took under history_name.
+  void SetResultCache(const Resource& cache_script,
+                      const std::vector<Resource>& key_files,
+                      const std::string& history_name) {
+    cache_script_ = cache_script;
+    cache_key_files_ = key_files;
+    cache_history_name_ = history_name;
+  }
 
   // Static preprocessors
   static void WriteMakeHead(const Input& input, Makefile* out);
@@ -71,7 +81,9 @@ class GenShNode : public Node {
   std::map<std::string, std::string> local_env_vars_;
   bool cd_;
   std::string make_name_, make_target_;
-  bool escape_command_;
+  Resource cache_script_;
+  std::vector<Resource> cache_key_files_;
+  std::string cache_history_name_;
 };
 
 }  // namespace repobuild
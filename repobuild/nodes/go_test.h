@@ -19,6 +19,7 @@ class GoTestNode : public GoLibraryNode {
   virtual ~GoTestNode() {}
   virtual bool IncludeInAll() const { return false; }
   virtual bool IncludeInTests() const { return true; }
+  virtual int DefaultTestSeconds() const { return 10; }  // "go test" links.
   virtual void Parse(BuildFile* file, const BuildFileNode& input);
   virtual void LocalWriteMake(Makefile* out) const;
   virtual void LocalTests(LanguageType lang,
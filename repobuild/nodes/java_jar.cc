@@ -62,17 +62,18 @@ Resource JavaJarNode::MoveFiles(const Resource& root,
   Makefile::Rule* rule = out->StartRule(touchfile.path(), input.path());
   string relative_path = strings::GetRelativePath(root.path(), input.dirname());
   rule->WriteCommand("mkdir -p " + root.path());
-  string file = strings::JoinPath(relative_path, "$file");
+  // Our paths can be under $(OBJ_DIR), so only the shell text is escaped.
+  string file = strings::JoinPath(relative_path, Makefile::Escape("$file"));
   rule->WriteCommand(
+      Makefile::Escape("FILES=$(cd ") + input.dirname() +
+      Makefile::Escape("; find . -type f -o -type l); ") +
+      "cd " + root.path() + "; " +
       Makefile::Escape(
-          "FILES=$(cd " + input.dirname() + "; find . -type f -o -type l); "
-          "cd " + root.path() + "; "
           "for file in $FILES; do"
           " mkdir -p $(dirname $file);"
           " RELATIVE=$(FILE=$(dirname $file); while [ \"$FILE\" != \".\" ]; "
           "  do printf '../'; FILE=$(dirname $FILE); done); "
-          " ln -s -f $RELATIVE" + file + " $file; "
-          "done"));
+          " ln -s -f $RELATIVE") + file + Makefile::Escape(" $file; done"));
   rule->WriteCommand("mkdir -p " + touchfile.dirname());
   rule->WriteCommand("touch " + touchfile.path());
   out->FinishRule(rule);
@@ -5,14 +5,21 @@
 #include <set>
 #include <string>
 #include <vector>
+#include "common/base/flags.h"
 #include "common/log/log.h"
 #include "common/strings/path.h"
 #include "common/strings/strutil.h"
 #include "repobuild/env/input.h"
 #include "repobuild/nodes/java_library.h"
+#include "repobuild/nodes/javac_worker_java.h"
+#include "repobuild/nodes/javac_worker_pl.h"
 #include "repobuild/nodes/util.h"
 #include "repobuild/reader/buildfile.h"
 
+DEFINE_bool(javac_worker, false,
+            "Default for the JAVAC_WORKER make variable: if true, java "
+            "compiles go to a persistent javac JVM (javac_worker.pl).");
+
 using std::vector;
 using std::string;
 using std::set;
@@ -122,15 +129,16 @@ void JavaLibraryNode::WriteCompile(const ResourceFileSet& input_files,
       touchfile.path(),
       strings::JoinWith(" ",
                         strings::JoinAll(input_files.files(), " "),
-                        strings::JoinAll(sources_, " ")));
+                        strings::JoinAll(sources_, " "),
+                        "$(JAVAC_WORKER_FILES)"));
 
   // Mkdir commands.
   for (const string d : directories) {
     rule->WriteCommand("mkdir -p " + d);
   }
 
-  // Compile command.
-  string compile = "javac";
+  // Compile command, run by javac_worker.pl when JAVAC_WORKER=1.
+  string compile = "$(JAVAC_LAUNCHER) javac";
 
   // Collect class paths.
   set<string> java_classpath;
@@ -270,4 +278,40 @@ Resource JavaLibraryNode::RootTouchfile() const {
   return Resource::FromLocalPath(ObjectRoot().path(), ".dummy.touch");
 }
 
+// static
+void JavaLibraryNode::WriteMakeHead(const Input& input, Makefile* out) {
+  // Persistent javac, "make JAVAC_WORKER=1". Compiles go to one long-lived
+  // JVM per build tree, started on the first compile, so only that one
+  // pays for JVM startup and JIT warm-up.
+  string worker_script = strings::JoinPath(input.genfile_dir(),
+                                           "javac_worker.pl");
+  string worker_source = strings::JoinPath(input.genfile_dir(),
+                                           "javac_worker.java");
+  out->GenerateExecFile("JavacWorkerScript", worker_script,
+                        string(embed_javac_worker_pl_data(),
+                               embed_javac_worker_pl_size()));
+  out->GenerateExecFile("JavacWorkerSource", worker_source,
+                        string(embed_javac_worker_java_data(),
+                               embed_javac_worker_java_size()));
+
+  // The worker is built here rather than by javac_worker.pl, so a javac
+  // that cannot compile it fails the build instead of quietly compiling
+  // everything locally.
+  string worker_dir = strings::JoinPath(input.genfile_dir(), "javac_worker");
+  string worker_class = strings::JoinPath(worker_dir, "JavacWorker.class");
+  Makefile::Rule* rule = out->StartRule(worker_class, worker_source);
+  rule->WriteUserEcho("Compiling", worker_source + " (java)");
+  rule->WriteCommand("mkdir -p " + worker_dir);
+  rule->WriteCommand("javac -d " + worker_dir + " " + worker_source);
+  out->FinishRule(rule);
+
+  out->append(string("JAVAC_WORKER ?= ") +
+              (FLAGS_javac_worker ? "1" : "0") + "\n");
+  out->append("ifeq ($(JAVAC_WORKER),1)\n");
+  out->append("\tJAVAC_WORKER_FILES := " + worker_script + " " +
+              worker_class + "\n");
+  out->append("\tJAVAC_LAUNCHER := " + worker_script + " compile\n");
+  out->append("endif\n\n");
+}
+
 }  // namespace repobuild
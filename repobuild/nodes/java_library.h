@@ -37,6 +37,9 @@ class JavaLibraryNode : public Node {
   virtual void LocalDependencyFiles(LanguageType lang,
                                     ResourceFileSet* files) const;
 
+  // The persistent javac worker (--javac_worker, JAVAC_WORKER=1).
+  static void WriteMakeHead(const Input& input, Makefile* out);
+
   // For direct construction.
   void Set(BuildFile* file,
            const BuildFileNode& input,
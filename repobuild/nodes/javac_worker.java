@@ -0,0 +1,224 @@
+// Persistent javac for repobuild generated Makefiles, started and used by
+// javac_worker.pl. Compiles run in this JVM with the javax.tools compiler,
+// so JVM startup and JIT warm-up are paid once per build tree instead of
+// once per java_library.
+//
+//  java -cp <dir> JavacWorker <dir>
+//    Listens on an ephemeral 127.0.0.1 port, and writes "<port> <token>" to
+//    <dir>/port (readable only by us). Clients must send the token. Exits
+//    after $JAVAC_WORKER_IDLE seconds (default 900) without requests, or
+//    once <dir>/port is gone (make clean) or names another worker.
+//
+// Protocol: every message is a list of fields, each "<length>\n<bytes>".
+//  request:  "repobuild-javac-1", <token>, <working dir>, <argc>, <args>...
+//  response: "local" (run javac yourself)
+//         or "done", <exit status>, <javac output>
+
+import java.io.BufferedInputStream;
+import java.io.BufferedOutputStream;
+import java.io.ByteArrayOutputStream;
+import java.io.File;
+import java.io.IOException;
+import java.io.InputStream;
+import java.io.OutputStream;
+import java.net.InetAddress;
+import java.net.ServerSocket;
+import java.net.Socket;
+import java.net.SocketTimeoutException;
+import java.nio.charset.StandardCharsets;
+import java.nio.file.Files;
+import java.nio.file.Path;
+import java.nio.file.Paths;
+import java.nio.file.StandardCopyOption;
+import java.security.SecureRandom;
+import java.util.ArrayList;
+import java.util.List;
+import java.util.concurrent.ExecutorService;
+import java.util.concurrent.Executors;
+import java.util.concurrent.TimeUnit;
+import java.util.concurrent.atomic.AtomicInteger;
+import java.util.concurrent.atomic.AtomicLong;
+import javax.tools.JavaCompiler;
+import javax.tools.ToolProvider;
+
+class JavacWorker {
+  private static final String kVersion = "repobuild-javac-1";
+  private static final int kMaxField = 64 << 20;
+  private static final int kReadTimeoutMillis = 60000;
+
+  private final JavaCompiler compiler = ToolProvider.getSystemJavaCompiler();
+  private final String workingDir;
+  private final String token;
+  private final AtomicLong lastRequest =
+      new AtomicLong(System.currentTimeMillis());
+  private final AtomicInteger active = new AtomicInteger();
+
+  private JavacWorker(String workingDir, String token) {
+    this.workingDir = workingDir;
+    this.token = token;
+  }
+
+  // Returns null at end of stream or on a malformed field.
+  private static String readField(InputStream in) throws IOException {
+    int len = 0;
+    int digits = 0;
+    for (int c = in.read(); c != '\n'; c = in.read()) {
+      if (c < '0' || c > '9' || ++digits > 9) {
+        return null;
+      }
+      len = len * 10 + (c - '0');
+    }
+    if (digits == 0 || len > kMaxField) {
+      return null;
+    }
+    byte[] data = new byte[len];
+    for (int read = 0; read < len; ) {
+      int n = in.read(data, read, len - read);
+      if (n < 0) {
+        return null;
+      }
+      read += n;
+    }
+    return new String(data, StandardCharsets.UTF_8);
+  }
+
+  private static void writeField(OutputStream out, byte[] data)
+      throws IOException {
+    out.write((data.length + "\n").getBytes(StandardCharsets.UTF_8));
+    out.write(data);
+  }
+
+  private static void writeField(OutputStream out, String data)
+      throws IOException {
+    writeField(out, data.getBytes(StandardCharsets.UTF_8));
+  }
+
+  private void handle(Socket client) {
+    try (Socket socket = client) {
+      // A client that stops mid-request must not hold a thread forever.
+      socket.setSoTimeout(kReadTimeoutMillis);
+      InputStream in = new BufferedInputStream(socket.getInputStream());
+      OutputStream out = new BufferedOutputStream(socket.getOutputStream());
+      if (!kVersion.equals(readField(in)) || !token.equals(readField(in))) {
+        return;
+      }
+      String dir = readField(in);
+      String argc = readField(in);
+      if (dir == null || argc == null || !argc.matches("\\d{1,6}")) {
+        return;
+      }
+      List<String> args = new ArrayList<String>();
+      for (int i = Integer.parseInt(argc); i > 0; --i) {
+        String arg = readField(in);
+        if (arg == null) {
+          return;
+        }
+        args.add(arg);
+      }
+
+      // Relative paths in args are resolved against our working directory.
+      if (compiler == null || !sameDir(dir)) {
+        writeField(out, "local");
+      } else {
+        ByteArrayOutputStream output = new ByteArrayOutputStream();
+        active.incrementAndGet();
+        int status;
+        try {
+          status = compiler.run(null, output, output,
+                                args.toArray(new String[args.size()]));
+        } finally {
+          active.decrementAndGet();
+          lastRequest.set(System.currentTimeMillis());
+        }
+        writeField(out, "done");
+        writeField(out, Integer.toString(status));
+        writeField(out, output.toByteArray());
+      }
+      out.flush();
+    } catch (IOException | RuntimeException e) {
+      // The client falls back to running javac itself.
+    }
+  }
+
+  private boolean sameDir(String dir) {
+    try {
+      return new File(dir).getCanonicalPath().equals(workingDir);
+    } catch (IOException e) {
+      return false;
+    }
+  }
+
+  // Temporary files are only readable by us, and so is the port file they
+  // are renamed to.
+  private static void writePortFile(Path file, String contents)
+      throws IOException {
+    Path tmp = Files.createTempFile(file.getParent(), "port", ".tmp");
+    Files.write(tmp, contents.getBytes(StandardCharsets.UTF_8));
+    Files.move(tmp, file, StandardCopyOption.REPLACE_EXISTING,
+               StandardCopyOption.ATOMIC_MOVE);
+  }
+
+  private static String portFileContents(Path file) {
+    try {
+      return new String(Files.readAllBytes(file), StandardCharsets.UTF_8);
+    } catch (IOException e) {
+      return "";
+    }
+  }
+
+  public static void main(String[] argv) throws Exception {
+    if (argv.length != 1) {
+      System.err.println("usage: JavacWorker <dir>");
+      System.exit(1);
+    }
+    Path portFile = Paths.get(argv[0], "port");
+    String idle = System.getenv("JAVAC_WORKER_IDLE");
+    long idleMillis = 1000L * (idle != null && idle.matches("\\d+") ?
+                               Long.parseLong(idle) : 900);
+
+    byte[] random = new byte[16];
+    new SecureRandom().nextBytes(random);
+    StringBuilder token = new StringBuilder();
+    for (byte b : random) {
+      token.append(String.format("%02x", b & 0xff));
+    }
+    final JavacWorker worker = new JavacWorker(
+        new File(".").getCanonicalPath(), token.toString());
+
+    ServerSocket server = new ServerSocket(0, 128,
+                                           InetAddress.getLoopbackAddress());
+    server.setSoTimeout(5000);
+    String contents = server.getLocalPort() + " " + token + "\n";
+    writePortFile(portFile, contents);
+    System.err.println("JavacWorker: serving " + worker.workingDir +
+                       " on port " + server.getLocalPort());
+
+    ExecutorService pool = Executors.newFixedThreadPool(
+        Runtime.getRuntime().availableProcessors());
+    while (true) {
+      try {
+        final Socket client = server.accept();
+        pool.execute(new Runnable() {
+          public void run() {
+            worker.handle(client);
+          }
+        });
+      } catch (SocketTimeoutException e) {
+        if (!contents.equals(portFileContents(portFile)) ||
+            (worker.active.get() == 0 &&
+             System.currentTimeMillis() - worker.lastRequest.get() >
+             idleMillis)) {
+          break;
+        }
+      }
+    }
+    // Let compiles accepted before the last idle check finish.
+    server.close();
+    pool.shutdown();
+    pool.awaitTermination(1, TimeUnit.HOURS);
+    if (contents.equals(portFileContents(portFile))) {
+      Files.deleteIfExists(portFile);
+    }
+    System.exit(0);
+  }
+}
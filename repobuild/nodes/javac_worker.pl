@@ -0,0 +1,158 @@
+#!/usr/bin/perl
+# Persistent javac for repobuild generated Makefiles.
+#
+#  javac_worker.pl compile <javac command>
+#    Sends the compile to this build tree's JavacWorker JVM, starting one in
+#    the background if none is running. The worker is javac_worker/
+#    JavacWorker.class, next to this script, which the Makefile builds from
+#    javac_worker.java; the worker writes its port file and log there too.
+#    Runs <javac command> locally when the worker cannot be started or
+#    reached, or when the command cannot be sent (-J options, @argfiles).
+#
+# Protocol: every message is a list of fields, each "<length>\n<bytes>".
+#  request:  "repobuild-javac-1", <token>, <working dir>, <argc>, <args>...
+#  response: "local" (run javac yourself)
+#         or "done", <exit status>, <javac output>
+
+use warnings;
+use strict;
+use Cwd qw(getcwd);
+use Fcntl qw(:flock);
+use File::Basename qw(dirname);
+use IO::Socket::INET;
+use POSIX qw(setsid);
+
+my $kVersion = "repobuild-javac-1";
+my $kDir = dirname($0) . "/javac_worker";
+
+# A worker that drops the connection (wrong token, or it exited) must send
+# us back to running javac ourselves, not kill us mid-write.
+$SIG{PIPE} = "IGNORE";
+
+sub WriteField {
+    my ($sock, $data) = @_;
+    print $sock length($data) . "\n" . $data;
+}
+
+sub ReadField {
+    my ($sock) = @_;
+    my $len = <$sock>;
+    return undef unless defined($len) && $len =~ /^(\d+)\n$/;
+    $len = $1;
+    my $data = "";
+    while (length($data) < $len) {
+        my $n = read($sock, $data, $len - length($data), length($data));
+        return undef unless $n;
+    }
+    return $data;
+}
+
+sub Run {
+    my (@command) = @_;
+    my $pid = fork();
+    die("fork: $!\n") unless defined($pid);
+    if ($pid == 0) {
+        exec(@command) || exit(127);
+    }
+    waitpid($pid, 0);
+    return ($? & 127) ? 1 : ($? >> 8);
+}
+
+# Returns a connection to the worker, after its token, or undef.
+sub Connect {
+    open(my $fh, "<", "$kDir/port") || return undef;
+    my $line = <$fh>;
+    close($fh);
+    return undef unless defined($line) && $line =~ /^(\d+) (\w+)$/;
+    my ($port, $token) = ($1, $2);
+    my $sock = IO::Socket::INET->new(PeerAddr => "127.0.0.1:$port",
+                                     Proto => "tcp",
+                                     Timeout => 2) || return undef;
+    binmode($sock);
+    WriteField($sock, $kVersion);
+    WriteField($sock, $token);
+    return $sock;
+}
+
+# Starts a worker, unless another client just did. Returns whether one is
+# running.
+sub StartWorker {
+    my ($javac) = @_;
+    mkdir($kDir);
+    open(my $lock, ">", "$kDir/lock") || return 0;
+    flock($lock, LOCK_EX) || return 0;
+    my $sock = Connect();
+    if (defined($sock)) {
+        close($sock);
+        return 1;
+    }
+
+    return 0 unless -f "$kDir/JavacWorker.class";
+    (my $java = $javac) =~ s/javac$/java/;
+    my @jvm_flags = split(" ", $ENV{JAVAC_WORKER_JVMFLAGS} || "");
+    unlink("$kDir/port");
+    my $pid = fork();
+    return 0 unless defined($pid);
+    if ($pid == 0) {
+        # Detach from make: our output and process group are not its.
+        setsid();
+        open(STDIN, "<", "/dev/null");
+        open(STDOUT, ">>", "$kDir/worker.log") || exit(127);
+        open(STDERR, ">&", \*STDOUT) || exit(127);
+        exec($java, @jvm_flags, "-cp", $kDir, "JavacWorker", $kDir) ||
+            exit(127);
+    }
+
+    # Wait for the worker to write its port file.
+    for (1..200) {
+        last if waitpid($pid, POSIX::WNOHANG()) != 0;
+        if (-f "$kDir/port") {
+            $sock = Connect();
+            if (defined($sock)) {
+                close($sock);
+                return 1;
+            }
+        }
+        select(undef, undef, undef, 0.1);
+    }
+    print STDERR "javac_worker: could not start a worker, see " .
+        "$kDir/worker.log\n";
+    return 0;
+}
+
+# Returns undef if the worker is unreachable or declines, otherwise
+# [status, output].
+sub TryWorker {
+    my (@command) = @_;
+    my $sock = Connect() || return undef;
+    WriteField($sock, getcwd());
+    WriteField($sock, scalar(@command) - 1);
+    WriteField($sock, $_) for @command[1..$#command];
+    $sock->flush();
+    my $reply = ReadField($sock);
+    return undef unless defined($reply) && $reply eq "done";
+    my @result = (ReadField($sock), ReadField($sock));
+    return undef if grep { !defined($_) } @result;
+    return \@result;
+}
+
+sub Compile {
+    my (@command) = @_;
+    return Run(@command)
+        if grep { /^(-J|@)/ } @command[1..$#command];
+    my $result = TryWorker(@command);
+    if (!defined($result) && StartWorker($command[0])) {
+        $result = TryWorker(@command);
+    }
+    return Run(@command) unless defined($result);
+    my ($status, $output) = @$result;
+    print STDERR $output;
+    return $status;
+}
+
+my $mode = shift(@ARGV) || "";
+if ($mode eq "compile" && @ARGV) {
+    exit(Compile(@ARGV));
+} else {
+    die("usage: $0 compile <javac command>\n");
+}
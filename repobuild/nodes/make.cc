@@ -12,6 +12,7 @@
 #include "repobuild/env/resource.h"
 #include "repobuild/nodes/make.h"
 #include "repobuild/nodes/gen_sh.h"
+#include "repobuild/nodes/makefile.h"
 #include "repobuild/reader/buildfile.h"
 
 using std::map;
@@ -29,11 +30,13 @@ void MakeNode::ParseWithOptions(BuildFile* file,
 
   // configure_args
   string user_postinstall;
-  current_reader()->ParseStringField("postinstall", true, &user_postinstall);
+  current_reader()->ParseMakeStringField("postinstall", true,
+                                         &user_postinstall);
 
   // make_target
   string make_target;
-  if (!current_reader()->ParseStringField("make_target", true, &make_target)) {
+  if (!current_reader()->ParseMakeStringField("make_target", true,
+                                              &make_target)) {
     make_target = "install";
   }
 
@@ -42,13 +45,13 @@ void MakeNode::ParseWithOptions(BuildFile* file,
   string pass_flags;
   current_reader()->ParseStringField("pass_flags", &pass_flags);
   if (pass_flags == "full") {
-    make_args.push_back("CXXFLAGS=\"$CXXFLAGS\"");
-    make_args.push_back("CFLAGS=\"$CFLAGS\"");
-    make_args.push_back("LDFLAGS=\"$LDFLAGS\"");
+    make_args.push_back(Makefile::Escape("CXXFLAGS=\"$CXXFLAGS\""));
+    make_args.push_back(Makefile::Escape("CFLAGS=\"$CFLAGS\""));
+    make_args.push_back(Makefile::Escape("LDFLAGS=\"$LDFLAGS\""));
   } else if (pass_flags == "basic") {
-    make_args.push_back("CXXFLAGS=\"$BASIC_CXXFLAGS\"");
-    make_args.push_back("CFLAGS=\"$BASIC_CFLAGS\"");
-    make_args.push_back("LDFLAGS=\"$LDFLAGS\"");
+    make_args.push_back(Makefile::Escape("CXXFLAGS=\"$BASIC_CXXFLAGS\""));
+    make_args.push_back(Makefile::Escape("CFLAGS=\"$BASIC_CFLAGS\""));
+    make_args.push_back(Makefile::Escape("LDFLAGS=\"$LDFLAGS\""));
   } else if (!pass_flags.empty()) {
     LOG(FATAL) << "Unknown value for \"pass_flags\" in make rule: "
                << pass_flags << " from target " << target().full_path();
@@ -56,7 +59,7 @@ void MakeNode::ParseWithOptions(BuildFile* file,
 
   // make_args
   make_args.push_back("DESTDIR=" + dest_dir);
-  current_reader()->ParseRepeatedString("make_args", true, &make_args);
+  current_reader()->ParseRepeatedMakeString("make_args", true, &make_args);
   string make_args_str = strings::JoinAll(make_args, " ");
 
   // make_file
@@ -77,8 +80,9 @@ void MakeNode::ParseWithOptions(BuildFile* file,
   gen->SetCd(true);
   gen->SetMakeName("Make");
 
-  string make_cmd = ("$MAKE " + make_args_str + " -f " + make_file + " "
-                     + make_target);
+  // Makefile text, like our inputs.
+  string make_cmd = (Makefile::Escape("$MAKE ") + make_args_str + " -f " +
+                     make_file + " " + make_target);
   if (!preinstall.empty()) {
     make_cmd = preinstall + " && " + make_cmd;
   }
@@ -88,7 +92,8 @@ void MakeNode::ParseWithOptions(BuildFile* file,
   if (!user_postinstall.empty()) {
     make_cmd += " && " + user_postinstall;
   }
-  string clean_cmd = ("$MAKE " +  make_args_str + " clean > /dev/null 2>&1 "
+  string clean_cmd = (Makefile::Escape("$MAKE ") + make_args_str +
+                      " clean > /dev/null 2>&1 "
                       "|| echo -n \"\"");  // always succeed.
 
   vector<Resource> input_files;
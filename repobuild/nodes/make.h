@@ -18,8 +18,9 @@ class MakeNode : public Node {
   }
   virtual ~MakeNode() {}
   virtual void Parse(BuildFile* file, const BuildFileNode& input) {
-    ParseWithOptions(file, input, "", "$GEN_DIR", "");
+    ParseWithOptions(file, input, "", "$$GEN_DIR", "");
   }
+  // preinstall, dest_dir and postinstall are makefile text.
   void ParseWithOptions(BuildFile* file,
                         const BuildFileNode& input,
                         const std::string& preinstall,
@@ -83,8 +83,12 @@ void Node::PostParse() {
   InitComponentHelpers();
 }
 
-void Node::WriteMake(Makefile* out) const {
+void Node::WriteMakeVariables(Makefile* out) const {
   WriteVariables(out->mutable_out());
+  LocalWriteMakeVariables(out);
+}
+
+void Node::WriteMake(Makefile* out) const {
   LocalWriteMake(out);
 }
 
@@ -482,15 +486,23 @@ void Node::AddConditionalVariable(const std::string& var_name,
                                   const std::string& condition_name,
                                   const std::string& true_value,
                                   const std::string& false_value) {
+  AddConditionalMakeVariable(var_name, condition_name,
+                             Makefile::Escape(true_value),
+                             Makefile::Escape(false_value));
+}
+
+void Node::AddConditionalMakeVariable(const std::string& var_name,
+                                      const std::string& condition_name,
+                                      const std::string& true_value,
+                                      const std::string& false_value) {
   if (true_value == false_value) {
     if (!true_value.empty()) {
-      MutableVariable(var_name)->SetValue(Makefile::Escape(true_value));
+      MutableVariable(var_name)->SetValue(true_value);
     }
   } else {
-    MutableVariable(var_name)->SetCondition(
-        condition_name,
-        Makefile::Escape(true_value),
-        Makefile::Escape(false_value));
+    MutableVariable(var_name)->SetCondition(condition_name,
+                                            true_value,
+                                            false_value);
   }
 }
 
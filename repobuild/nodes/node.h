@@ -45,7 +45,10 @@ class Node {
   virtual void Parse(BuildFile* file, const BuildFileNode& input);
   virtual void PostParse();
 
-  // Makefile generation.
+  // Makefile generation. Variables of every node are written before any
+  // node's rules, since rules may name another node's variables in their
+  // prerequisites (which make expands as it reads them).
+  void WriteMakeVariables(Makefile* out) const;
   void WriteMake(Makefile* out) const;
   void WriteMakeClean(Makefile::Rule* rule) const;
   void WriteMakeInstall(Makefile* base, Makefile::Rule* rule) const;
@@ -65,6 +68,11 @@ class Node {
       std::map<std::string, std::string>* files) const {}
   virtual bool IncludeInAll() const { return true; }
   virtual bool IncludeInTests() const { return false; }
+  virtual bool IncludeInBenchmarks() const { return false; }
+
+  // How long a test runs when we have no history for it. "make tests" runs
+  // the longest tests first.
+  virtual int DefaultTestSeconds() const { return 0; }
 
   // Flag inheritence
   void LinkFlags(LanguageType lang,
@@ -112,6 +120,7 @@ class Node {
 
   // The main thing to override.
   virtual void LocalWriteMake(Makefile* out) const = 0;
+  virtual void LocalWriteMakeVariables(Makefile* out) const {}
   virtual void LocalWriteMakeClean(Makefile::Rule* out) const {}
   virtual void LocalWriteMakeInstall(Makefile* base,
                                      Makefile::Rule* out) const {
@@ -182,6 +191,12 @@ class Node {
                               const std::string& condition_name,
                               const std::string& true_value,
                               const std::string& false_value);
+  // As above, for values that are already makefile text (e.g. paths under
+  // $(OBJ_DIR)).
+  void AddConditionalMakeVariable(const std::string& var_name,
+                                  const std::string& condition_name,
+                                  const std::string& true_value,
+                                  const std::string& false_value);
 
   // Dependency helpers
   void InputDependencyFiles(LanguageType lang, ResourceFileSet* files) const;
@@ -14,6 +14,7 @@
 #include "repobuild/nodes/gen_sh.h"
 #include "repobuild/nodes/go_library.h"
 #include "repobuild/nodes/java_library.h"
+#include "repobuild/nodes/makefile.h"
 #include "repobuild/nodes/translate_and_compile.h"
 #include "repobuild/nodes/py_library.h"
 #include "repobuild/reader/buildfile.h"
@@ -58,7 +59,8 @@ void TranslateAndCompileNode::Parse(BuildFile* file,
   gen_node_->SetCd(false);
   gen_node_->SetMakeName(translator_);
 
-  string translator_binary = "$" + string(kTranslatorVar);
+  // The command is makefile text.
+  string translator_binary = Makefile::Escape("$" + string(kTranslatorVar));
 
   // Figure out which languages to generates.
   bool generate_cc = false;
@@ -80,8 +82,8 @@ void TranslateAndCompileNode::Parse(BuildFile* file,
   if (generate_cc) {
     has_language = true;
     vector<string> cc_translator_args;
-    current_reader()->ParseRepeatedString("cc.translator_args",
-					  &cc_translator_args);
+    current_reader()->ParseRepeatedMakeString("cc.translator_args", false,
+					      &cc_translator_args);
     build_cmd += " " + strings::JoinAll(cc_translator_args, " ");
     GenerateCpp(input_prefixes, &outputs, file);
   }
@@ -90,8 +92,8 @@ void TranslateAndCompileNode::Parse(BuildFile* file,
   if (generate_java) {
     has_language = true;
     vector<string> java_translator_args;
-    current_reader()->ParseRepeatedString("java.translator_args",
-					  &java_translator_args);
+    current_reader()->ParseRepeatedMakeString("java.translator_args", false,
+					      &java_translator_args);
     build_cmd += " " + strings::JoinAll(java_translator_args, " ");
     vector<string> java_classnames;
     current_reader()->ParseRepeatedString("java_classnames", &java_classnames);
@@ -102,8 +104,8 @@ void TranslateAndCompileNode::Parse(BuildFile* file,
   if (generate_python) {
     has_language = true;
     vector<string> py_translator_args;
-    current_reader()->ParseRepeatedString("py.translator_args",
-					  &py_translator_args);
+    current_reader()->ParseRepeatedMakeString("py.translator_args", false,
+					      &py_translator_args);
     build_cmd += " " + strings::JoinAll(py_translator_args, " ");
     GeneratePython(input_prefixes, &outputs, file);
   }
@@ -112,8 +114,8 @@ void TranslateAndCompileNode::Parse(BuildFile* file,
   if (generate_go) {
     has_language = true;
     vector<string> go_translator_args;
-    current_reader()->ParseRepeatedString("go.translator_args",
-					  &go_translator_args);
+    current_reader()->ParseRepeatedMakeString("go.translator_args", false,
+					      &go_translator_args);
     build_cmd += " " + strings::JoinAll(go_translator_args, " ");
     GenerateGo(input_prefixes, &outputs, file);
   }
@@ -125,7 +127,8 @@ void TranslateAndCompileNode::Parse(BuildFile* file,
 
   // Common translator args
   vector<string> translator_args;
-  current_reader()->ParseRepeatedString("translator_args", &translator_args);
+  current_reader()->ParseRepeatedMakeString("translator_args", false,
+                                            &translator_args);
   build_cmd += " " + strings::JoinAll(translator_args, " ");
 
   build_cmd += " " + strings::JoinAll(input_files, " ");
@@ -206,9 +209,10 @@ void TranslateAndCompileNode::GenerateCpp(
   // dummies:
   vector<Resource> objects;
   vector<string> cc_compile_args, header_compile_args;
-  current_reader()->ParseRepeatedString("cc.cc_compile_args", &cc_compile_args);
-  current_reader()->ParseRepeatedString("cc.header_compile_args",
-					&header_compile_args);
+  current_reader()->ParseRepeatedMakeString("cc.cc_compile_args", false,
+                                            &cc_compile_args);
+  current_reader()->ParseRepeatedMakeString("cc.header_compile_args", false,
+					    &header_compile_args);
   cc_node_->Set(cc_sources, cc_headers, objects,
                 cc_compile_args, header_compile_args);
 
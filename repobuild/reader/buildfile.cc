@@ -1,6 +1,7 @@
 // Copyright 2013
 // Author: Christopher Van Arsdale
 
+#include <algorithm>
 #include <map>
 #include <set>
 #include <string>
@@ -10,7 +11,6 @@
 #include "common/util/stl.h"
 #include "common/strings/path.h"
 #include "common/strings/strutil.h"
-#include "common/strings/varmap.h"
 #include "repobuild/distsource/dist_source.h"
 #include "repobuild/env/resource.h"
 #include "repobuild/reader/buildfile.h"
@@ -20,12 +20,30 @@ using std::set;
 using std::string;
 using std::vector;
 using std::map;
+using std::make_pair;
 
 namespace repobuild {
 namespace {
+// KeyPath
+//  Dotted attribute keys (e.g. "gcc.cc_compile_args") split into their
+//  components. Every node of a given type asks for the same keys, so we split
+//  each distinct key once and reuse it.
+const vector<string>& KeyPath(const string& key) {
+  static map<string, vector<string> >* kKeyPaths =
+      new map<string, vector<string> >;
+  auto it = kKeyPaths->find(key);
+  if (it == kKeyPaths->end()) {
+    it = kKeyPaths->insert(make_pair(key, strings::SplitString(key, "."))).first;
+  }
+  return it->second;
+}
+
 const Json::Value& GetValue(const BuildFileNode& input, const string& key) {
   const Json::Value* current = &input.object();
-  for (const string& subkey : strings::SplitString(key, ".")) {
+  if (key.find('.') == string::npos) {
+    return (*current)[key];
+  }
+  for (const string& subkey : KeyPath(key)) {
     if (current->isNull()) {
       break;
     }
@@ -33,6 +51,11 @@ const Json::Value& GetValue(const BuildFileNode& input, const string& key) {
   }
   return *current;
 }
+
+bool LongerName(const std::pair<string, string>& a,
+                const std::pair<string, string>& b) {
+  return a.first.size() > b.first.size();
+}
 }  // anonymous namespace
 
 BuildFileNode::BuildFileNode(const Json::Value& object) {
@@ -48,7 +71,7 @@ void BuildFileNode::Reset(const Json::Value& object) {
 
 BuildFile::~BuildFile() {
   DeleteElements(&nodes_);
-  DeleteElements(&owned_rewriters_);
+  DeleteElements(&rewriters_);
 }
 
 void BuildFile::Parse(const string& input) {
@@ -79,43 +102,82 @@ string BuildFile::NextName(const string& name_base) {
 TargetInfo BuildFile::ComputeTargetInfo(const std::string& dependency) const {
   VLOG(1) << "ComputeTargetInfo: " << dependency;
   TargetInfo base(dependency, filename());
-  VLOG(1) << filename() << ": " << rewriters_.size();
-  for (int i = rewriters_.size() - 1; i >= 0; --i) {
-    if (rewriters_[i]->RewriteDependency(&base)) {
-      break;
+  RewriteDependency(&base);
+  return base;
+}
+
+bool BuildFile::RewriteDependency(TargetInfo* target) const {
+  string cache_key = (target->was_relative() ? "r" : "a") + target->full_path();
+  auto it = rewrite_cache_.find(cache_key);
+  if (it != rewrite_cache_.end()) {
+    if (it->second.first) {
+      *target = it->second.second;
     }
+    return it->second.first;
+  }
+
+  // Our own rewriters take precedence (latest first), then our parents'.
+  bool rewritten = false;
+  for (int i = rewriters_.size() - 1; i >= 0 && !rewritten; --i) {
+    rewritten = rewriters_[i]->RewriteDependency(target);
+  }
+  if (!rewritten && parent_ != NULL) {
+    rewritten = parent_->RewriteDependency(target);
+  }
+  rewrite_cache_[cache_key] = std::make_pair(rewritten, *target);
+  return rewritten;
+}
+
+void BuildFile::BaseDependencies(set<string>* deps) const {
+  for (const BuildFile* file = this; file != NULL; file = file->parent_) {
+    deps->insert(file->base_deps_.begin(), file->base_deps_.end());
   }
-  return base;
 }
 
-void BuildFile::MergeParent(BuildFile* parent) {
-  for (const string& dep : parent->base_dependencies()) {
-    base_deps_.insert(dep);
+void BuildFile::MergeDependency(const BuildFile* dependency) {
+  if (dependency != this) {
+    dependency->CollectKeys(&dependency_keys_);
   }
-  for (BuildDependencyRewriter* rewriter : parent->rewriters_) {
-    rewriters_.push_back(rewriter);
+}
+
+void BuildFile::CollectKeys(map<string, string>* keys) const {
+  // NB: insert() does not overwrite, so this mirrors FindKey precedence.
+  keys->insert(registered_keys_.begin(), registered_keys_.end());
+  if (parent_ != NULL) {
+    parent_->CollectKeys(keys);
   }
-  registered_keys_.insert(parent->registered_keys_.begin(),
-			  parent->registered_keys_.end());
+  keys->insert(dependency_keys_.begin(), dependency_keys_.end());
 }
 
-void BuildFile::MergeDependency(BuildFile* dependency) {
-  for (const auto& it : dependency->registered_keys_) {
-    registered_keys_.insert(it);  // doesn't insert if already in map.
+bool BuildFile::FindKey(const string& key, string* value) const {
+  // Precedence: our own keys, then anything our parents can see, then keys
+  // from BUILD files we depend on.
+  auto it = registered_keys_.find(key);
+  if (it != registered_keys_.end()) {
+    *value = it->second;
+    return true;
   }
+  if (parent_ != NULL && parent_->FindKey(key, value)) {
+    return true;
+  }
+  it = dependency_keys_.find(key);
+  if (it != dependency_keys_.end()) {
+    *value = it->second;
+    return true;
+  }
+  return false;
 }
 
 const std::string BuildFile::GetKey(const std::string& key) const {
-  const string kEmpty;
-  return FindWithDefault(registered_keys_, key, kEmpty);
+  string value;
+  FindKey(key, &value);
+  return value;
 }
 
 BuildFileNodeReader::BuildFileNodeReader(const BuildFileNode& node,
                                          DistSource* source)
     : input_(node),
       dist_source_(source),
-      var_map_true_(new strings::VarMap),
-      var_map_false_(new strings::VarMap),
       strict_file_mode_(true) {
 }
 
@@ -125,15 +187,34 @@ BuildFileNodeReader::~BuildFileNodeReader() {
 void BuildFileNodeReader::SetReplaceVariable(bool mode,
                                              const string& original,
                                              const string& replace) {
-  strings::VarMap* var = (mode ? var_map_true_.get() : var_map_false_.get());
-  var->Set("$" + original, replace);
-  var->Set("$(" + original + ")", replace);
-  var->Set("${" + original + "}", replace);
+  vector<std::pair<string, string> >* vars = &replace_vars_[mode ? 1 : 0];
+  for (auto& it : *vars) {
+    if (it.first == original) {
+      it.second = replace;
+      return;
+    }
+  }
+  vars->push_back(make_pair(original, replace));
+  std::stable_sort(vars->begin(), vars->end(), LongerName);
 }
 
 void BuildFileNodeReader::ParseRepeatedString(const string& key,
                                               bool mode,
                                               vector<string>* output) const {
+  ParseStrings(key, mode, false, output);
+}
+
+void BuildFileNodeReader::ParseRepeatedMakeString(
+    const string& key,
+    bool mode,
+    vector<string>* output) const {
+  ParseStrings(key, mode, true, output);
+}
+
+void BuildFileNodeReader::ParseStrings(const string& key,
+                                       bool mode,
+                                       bool make_text,
+                                       vector<string>* output) const {
   const Json::Value& array = GetValue(input_, key);
   if (!array.isNull()) {
     CHECK(array.isArray()) << "Expecting array for key " << key << ": "
@@ -143,7 +224,8 @@ void BuildFileNodeReader::ParseRepeatedString(const string& key,
       CHECK(single.isString()) << "Expecting string for item of " << key << ": "
                                << input_.object()
                                << ". Target: " << error_path_;
-      output->push_back(RewriteSingleString(mode, single.asString()));
+      output->push_back(
+          RewriteSingleString(mode, make_text, single.asString()));
       VLOG(1) << "Parsing string: "
               << single.asString()
               << " (" << key << ", " << mode << ") => "
@@ -166,7 +248,7 @@ void BuildFileNodeReader::ParseKeyValueStrings(
     const Json::Value& val = list[name];
     CHECK(val.isString()) << "Value var (\"" << name
                           << "\") must be string in " << error_path_;
-    (*output)[name] = RewriteSingleString(false, val.asString());
+    (*output)[name] = RewriteSingleString(false, false, val.asString());
   }
 }
 
@@ -178,11 +260,24 @@ bool BuildFileNodeReader::ParseStringField(const string& key,
 bool BuildFileNodeReader::ParseStringField(const string& key,
                                            bool mode,
                                            string* field) const {
+  return ParseString(key, mode, false, field);
+}
+
+bool BuildFileNodeReader::ParseMakeStringField(const string& key,
+                                               bool mode,
+                                               string* field) const {
+  return ParseString(key, mode, true, field);
+}
+
+bool BuildFileNodeReader::ParseString(const string& key,
+                                      bool mode,
+                                      bool make_text,
+                                      string* field) const {
   const Json::Value& json_field = GetValue(input_, key);
   if (!json_field.isString()) {
     return false;
   }
-  *field = RewriteSingleString(mode, json_field.asString());
+  *field = RewriteSingleString(mode, make_text, json_field.asString());
   return true;
 }
 
@@ -270,9 +365,74 @@ bool BuildFileNodeReader::ParseBoolField(const string& key,
   return true;
 }
 
+bool BuildFileNodeReader::ParseIntField(const string& key,
+                                        int* field) const {
+  const Json::Value& json_field = GetValue(input_, key);
+  if (!json_field.isInt()) {
+    return false;
+  }
+  *field = json_field.asInt();
+  return true;
+}
+
+bool BuildFileNodeReader::MatchVariable(
+    const vector<std::pair<string, string> >& vars,
+    const string& str,
+    size_t pos,
+    size_t* length,
+    const string** value) const {
+  // pos points just past the '$'. Accept $NAME, $(NAME) and ${NAME}.
+  char close = '\0';
+  if (pos < str.size() && (str[pos] == '(' || str[pos] == '{')) {
+    close = (str[pos] == '(' ? ')' : '}');
+    pos++;
+  }
+  for (const auto& it : vars) {
+    const string& name = it.first;
+    if (str.compare(pos, name.size(), name) != 0) {
+      continue;
+    }
+    size_t end = pos + name.size();
+    if (close != '\0') {
+      if (end >= str.size() || str[end] != close) {
+        continue;
+      }
+      end++;
+    }
+    *length = end - pos + (close != '\0' ? 2 : 1);  // include "$(" or "$".
+    *value = &it.second;
+    return true;
+  }
+  return false;
+}
+
 string BuildFileNodeReader::RewriteSingleString(bool mode,
+                                                bool make_text,
                                                 const string& str) const {
-  return (mode ? var_map_true_.get() : var_map_false_.get())->Replace(str);
+  size_t pos = str.find('$');
+  if (pos == string::npos) {
+    return str;
+  }
+
+  // Single left-to-right scan, replacing any known variable. For makefile
+  // text, any other '$' is escaped.
+  const vector<std::pair<string, string> >& vars = replace_vars_[mode ? 1 : 0];
+  string out = str.substr(0, pos);
+  while (pos != string::npos) {
+    size_t length = 0;
+    const string* value = NULL;
+    if (MatchVariable(vars, str, pos + 1, &length, &value)) {
+      out.append(*value);
+    } else {
+      out.append(make_text ? "$$" : "$");
+      length = 1;
+    }
+    size_t next = str.find('$', pos + length);
+    out.append(str, pos + length,
+               (next == string::npos ? str.size() : next) - pos - length);
+    pos = next;
+  }
+  return out;
 }
 
 }  // namespace repobuild
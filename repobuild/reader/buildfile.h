@@ -8,6 +8,7 @@
 #include <map>
 #include <set>
 #include <string>
+#include <utility>
 #include <vector>
 #include "common/base/macros.h"
 #include "repobuild/env/target.h"
@@ -15,9 +16,6 @@
 namespace Json {
 class Value;
 }
-namespace strings {
-class VarMap;
-}
 
 namespace repobuild {
 class DistSource;
@@ -38,17 +36,23 @@ class BuildFileNode {
   std::unique_ptr<Json::Value> object_;
 };
 
+// BuildFile
+//  A parsed BUILD file. Configuration inherited from parent directories
+//  (base dependencies, dependency rewriters, registered keys) is not copied:
+//  each file references its parent's BuildFile and layers its own values on
+//  top, so lookups walk up the (already fully parsed) parent chain.
 class BuildFile {
  public:
   explicit BuildFile(const std::string& filename)
-      : filename_(filename) {
+      : filename_(filename),
+        parent_(NULL) {
   }
   ~BuildFile();
 
   // Mutators
   void Parse(const std::string& input);
-  void MergeParent(BuildFile* parent);
-  void MergeDependency(BuildFile* dependency);
+  void SetParent(const BuildFile* parent) { parent_ = parent; }
+  void MergeDependency(const BuildFile* dependency);
   void AddBaseDependency(const std::string& dep) { base_deps_.insert(dep); }
   void RegisterKey(const std::string& key, const std::string& value) {
     registered_keys_[key] = value;
@@ -62,14 +66,15 @@ class BuildFile {
     virtual bool RewriteDependency(TargetInfo* target) = 0;
   };
   void AddDependencyRewriter(BuildDependencyRewriter* rewriter) {
-    owned_rewriters_.push_back(rewriter);
     rewriters_.push_back(rewriter);
+    rewrite_cache_.clear();
   }
 
   // Accessors.
   const std::string& filename() const { return filename_; }
+  const BuildFile* parent() const { return parent_; }
   const std::vector<BuildFileNode*>& nodes() const { return nodes_; }
-  const std::set<std::string>& base_dependencies() const { return base_deps_; }
+  void BaseDependencies(std::set<std::string>* deps) const;
   const std::string GetKey(const std::string& key) const;
 
   // Helpers.
@@ -77,12 +82,22 @@ class BuildFile {
   TargetInfo ComputeTargetInfo(const std::string& dependency) const;
 
  private:
+  bool RewriteDependency(TargetInfo* target) const;
+  bool FindKey(const std::string& key, std::string* value) const;
+  void CollectKeys(std::map<std::string, std::string>* keys) const;
+
   std::string filename_;
+  const BuildFile* parent_;  // not owned.
   std::vector<BuildFileNode*> nodes_;
   std::set<std::string> base_deps_;
   std::map<std::string, int> name_counter_;
-  std::vector<BuildDependencyRewriter*> owned_rewriters_, rewriters_;
-  std::map<std::string, std::string> registered_keys_;
+  std::vector<BuildDependencyRewriter*> rewriters_;  // owned, local only.
+  std::map<std::string, std::string> registered_keys_;  // local only.
+  std::map<std::string, std::string> dependency_keys_;
+
+  // Memoized results of RewriteDependency for this scope, keyed on the
+  // (was_relative, full_path) of the input target.
+  mutable std::map<std::string, std::pair<bool, TargetInfo> > rewrite_cache_;
 };
 
 // BuildFileNodeReader
@@ -118,6 +133,15 @@ class BuildFileNodeReader {
                         bool mode,
                         std::string* field) const;
 
+  // Parse strings as makefile text: a '$' from the BUILD file is escaped,
+  // the replacement for $OBJ_DIR etc (which can be a make reference) is not.
+  void ParseRepeatedMakeString(const std::string& key,
+                               bool mode,
+                               std::vector<std::string>* output) const;
+  bool ParseMakeStringField(const std::string& key,
+                            bool mode,
+                            std::string* field) const;
+
   // Parse files.
   void ParseRepeatedFiles(const std::string& key,
                           std::vector<Resource>* output) const {
@@ -143,6 +167,10 @@ class BuildFileNodeReader {
   bool ParseBoolField(const std::string& key,
                       bool* field) const;
 
+  // Parse int.
+  bool ParseIntField(const std::string& key,
+                     int* field) const;
+
  private:
   void ParseFilesFromString(const std::vector<std::string>& input,
                             bool strict_file_mode,
@@ -150,12 +178,29 @@ class BuildFileNodeReader {
 
   DISALLOW_COPY_AND_ASSIGN(BuildFileNodeReader);
 
-  std::string RewriteSingleString(bool mode, const std::string& str) const;
+  void ParseStrings(const std::string& key,
+                    bool mode,
+                    bool make_text,
+                    std::vector<std::string>* output) const;
+  bool ParseString(const std::string& key,
+                   bool mode,
+                   bool make_text,
+                   std::string* field) const;
+  std::string RewriteSingleString(bool mode,
+                                  bool make_text,
+                                  const std::string& str) const;
+  bool MatchVariable(const std::vector<std::pair<std::string, std::string> >&,
+                     const std::string& str,
+                     size_t pos,
+                     size_t* length,
+                     const std::string** value) const;
 
   const BuildFileNode& input_;
   DistSource* dist_source_;
-  std::unique_ptr<strings::VarMap> var_map_true_;
-  std::unique_ptr<strings::VarMap> var_map_false_;
+
+  // Variable name -> replacement, one list per mode. Kept sorted longest name
+  // first so a single left-to-right scan picks the longest match.
+  std::vector<std::pair<std::string, std::string> > replace_vars_[2];
   std::set<std::string> abs_prefix_;
   bool strict_file_mode_;
   std::string error_path_;
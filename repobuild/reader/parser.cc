@@ -217,7 +217,9 @@ class Graph {
     // Connect any additional dependencies from the build file.
     // TODO(cvanarsdale): We can only have one at the moment, due to how these
     // get added.
-    for (const string& additional_dep : file->base_dependencies()) {
+    set<string> base_dependencies;
+    file->BaseDependencies(&base_dependencies);
+    for (const string& additional_dep : base_dependencies) {
       Node* base_dep = nodes_[additional_dep];
       CHECK(base_dep);
       for (Node* node : nodes) {
@@ -272,20 +274,19 @@ class Graph {
     ExpandTarget(target);
   }
 
+  // ProcessParent
+  //  Links a BUILD file to the BUILD file in its parent directory. The parent
+  //  (and, recursively, its own parents) is fully processed first, and the
+  //  child references it rather than copying its configuration.
   void ProcessParent(BuildFile* child) {
-    BuildFile* current = child;
-    while (true) {
-      string current_dir = strings::PathDirname(current->filename());
-      if (current_dir == "." || current_dir == input_.root_dir()) {
-        break;
-      }
-
-      string parent_file = strings::JoinPath(
-          strings::JoinPath(current_dir, ".."), "BUILD");
-      BuildFile* parent = AddFile(parent_file);
-      child->MergeParent(parent);
-      current = parent;
+    string current_dir = strings::PathDirname(child->filename());
+    if (current_dir == "." || current_dir == input_.root_dir()) {
+      return;
     }
+
+    string parent_file = strings::JoinPath(
+        strings::JoinPath(current_dir, ".."), "BUILD");
+    child->SetParent(AddFile(parent_file));
   }
 
   bool ExpandPlugin(BuildFile* file,
@@ -6,9 +6,14 @@
 // [flag] => see env/input.cc
 //           Format is -FLAG_TYPE=FLAG_VALUE, e.g. -X=-Wno-error=asdf
 //           Compiler conditional args look like: -X=gcc=... or -X=clang=...
+//           Build configuration args look like: -C.asan=..., which also
+//           declare new configurations (besides opt, dbg and asan).
 // [targets] => see env/target.cc
 //              format is "path/to:target" or "//path/to:target"
 //
+// Reports on a previous build:
+//  ./repobuild report compile-time [--report_top=N] [--config=NAME]
+//
 // To build repobuild...
 // 1) With a make file:
 //  make repobuild
@@ -29,6 +34,7 @@
 #include "repobuild/env/input.h"
 #include "repobuild/env/target.h"
 #include "repobuild/generator/generator.h"
+#include "repobuild/report/compile_time.h"
 
 using std::vector;
 
@@ -43,11 +49,15 @@ const char* kUsage =
     "\n"
     "  To build:\n"
     "     make [-j8] [target]\n"
+    "     make [-j8] CONFIG=dbg [target]   (or opt, asan, ...)\n"
     "\n"
     "  To run:\n"
     "     ./.gen-obj/path/to/target\n"
     "         or\n"
-    "     ./target";
+    "     ./target\n"
+    "\n"
+    "  To see where compile time goes (after make CC_TIME_TRACE=1):\n"
+    "     repobuild report compile-time [--report_top=20] [--config=opt]";
 
 void ParseArg(bool no_flags,
               const StringPiece& arg,
@@ -86,6 +96,16 @@ int main(int argc, char** argv) {
   char** args = &ignored_args[0];
   InitProgram(&size, &args, kUsage, true);
 
+  // Reports read the output of a previous build, rather than BUILD files.
+  if (!saved_args.empty() && !strcmp(saved_args[0], "report")) {
+    repobuild::Input input;
+    if (saved_args.size() == 2 && !strcmp(saved_args[1], "compile-time")) {
+      std::cout << repobuild::CompileTimeReport(input);
+      return 0;
+    }
+    LOG(FATAL) << "Unknown report, expected: repobuild report compile-time";
+  }
+
   // Parse arguments.
   // 1) Arguments for compilation (-C=a, -X=a, -L=a, etc ... see env/input.cc)
   // 2) Build targets (e.g. ":repobuild" "common/strings/testing:strutil_test")
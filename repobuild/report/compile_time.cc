@@ -0,0 +1,181 @@
+// Copyright 2013
+// Author: Christopher Van Arsdale
+
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <map>
+#include <string>
+#include <utility>
+#include <vector>
+#include "common/base/flags.h"
+#include "common/file/fileutil.h"
+#include "common/log/log.h"
+#include "common/strings/path.h"
+#include "common/strings/strutil.h"
+#include "common/util/shell.h"
+#include "repobuild/env/input.h"
+#include "repobuild/report/compile_time.h"
+#include "repobuild/third_party/json/json.h"
+
+DEFINE_int32(report_top, 20,
+             "Number of entries in each section of a repobuild report.");
+
+using std::map;
+using std::pair;
+using std::string;
+using std::vector;
+
+namespace repobuild {
+namespace {
+const char kTraceSuffix[] = ".time-trace";
+
+// Seconds and number of occurrences, per translation unit, header or
+// template.
+struct Timing {
+  Timing() : seconds(0), count(0) {}
+  double seconds;
+  int count;
+};
+typedef map<string, Timing> TimingMap;
+
+void AddTiming(const string& name, double seconds, TimingMap* timings) {
+  Timing* timing = &(*timings)[name];
+  timing->seconds += seconds;
+  timing->count++;
+}
+
+// clang -ftime-trace, in the chrome trace event format. Durations are in
+// microseconds.
+void ParseClangTrace(const string& object,
+                     const string& contents,
+                     TimingMap* units,
+                     TimingMap* headers,
+                     TimingMap* templates) {
+  Json::Value root;
+  Json::Reader reader;
+  if (!reader.parse(contents, root) || !root["traceEvents"].isArray()) {
+    LOG(WARNING) << "Could not parse time trace for " << object;
+    return;
+  }
+  const Json::Value& events = root["traceEvents"];
+  double total = 0;
+  for (int i = 0; i < events.size(); ++i) {
+    const Json::Value& event = events[i];
+    if (!event["dur"].isNumeric()) {
+      continue;
+    }
+    string name = event["name"].asString();
+    double seconds = event["dur"].asDouble() / 1e6;
+    string detail = event["args"]["detail"].asString();
+    if (name == "ExecuteCompiler") {
+      total = seconds;
+    } else if (name == "Total ExecuteCompiler" && total == 0) {
+      total = seconds;
+    } else if (name == "Source") {
+      AddTiming(detail, seconds, headers);
+    } else if (name == "InstantiateClass" ||
+               name == "InstantiateFunction") {
+      AddTiming(detail, seconds, templates);
+    }
+  }
+  AddTiming(object, total, units);
+}
+
+// gcc -ftime-report. We only take the wall time of the TOTAL line:
+//  TOTAL   :   0.12          0.05          0.20           19M
+void ParseGccReport(const string& object,
+                    const string& contents,
+                    TimingMap* units) {
+  for (const string& line : strings::SplitString(contents, "\n")) {
+    size_t colon = line.find(':');
+    if (colon == string::npos ||
+        line.substr(0, colon).find("TOTAL") == string::npos) {
+      continue;
+    }
+    vector<string> columns = strings::SplitString(line.substr(colon + 1),
+                                                  " ");
+    if (columns.size() < 3) {
+      break;
+    }
+    AddTiming(object, strtod(columns[2].c_str(), NULL), units);
+    return;
+  }
+  LOG(WARNING) << "No TOTAL in time report for " << object;
+}
+
+void WriteSection(const string& title,
+                  const TimingMap& timings,
+                  bool with_count,
+                  string* out) {
+  if (timings.empty()) {
+    return;
+  }
+  vector<pair<double, string> > sorted;
+  for (const auto& it : timings) {
+    sorted.push_back(std::make_pair(it.second.seconds, it.first));
+  }
+  std::sort(sorted.rbegin(), sorted.rend());
+  if (sorted.size() > static_cast<size_t>(FLAGS_report_top)) {
+    sorted.resize(FLAGS_report_top);
+  }
+
+  out->append(title + ":\n");
+  for (const auto& it : sorted) {
+    if (with_count) {
+      out->append(strings::StringPrintf(
+          "  %9.3fs %6dx  %s\n",
+          it.first, timings.find(it.second)->second.count,
+          it.second.c_str()));
+    } else {
+      out->append(strings::StringPrintf("  %9.3fs  %s\n",
+                                        it.first, it.second.c_str()));
+    }
+  }
+  out->append("\n");
+}
+}  // anonymous namespace
+
+string CompileTimeReport(const Input& input) {
+  // The default build configuration's, or --config's.
+  string object_dir = strings::JoinPath(
+      input.root_dir(), input.ConfigObjectDir(input.default_config()));
+  string output;
+  util::Execute("/usr/bin/find " + object_dir +
+                " -name '*" + kTraceSuffix + "'", &output);
+  vector<string> traces = strings::SplitString(output, "\n");
+  if (traces.empty()) {
+    return "No compile time traces under " + object_dir +
+        ", build with \"make CC_TIME_TRACE=1\" first.\n";
+  }
+
+  TimingMap units, headers, templates;
+  for (const string& trace : traces) {
+    string object = trace.substr(0, trace.size() - strlen(kTraceSuffix));
+    string contents = file::ReadFileToStringOrDie(trace);
+    if (strings::HasPrefix(contents, "{")) {
+      ParseClangTrace(object, contents, &units, &headers, &templates);
+    } else {
+      ParseGccReport(object, contents, &units);
+    }
+  }
+
+  double total = 0;
+  for (const auto& it : units) {
+    total += it.second.seconds;
+  }
+  string out = strings::StringPrintf(
+      "%d translation units, %.3fs total.\n\n",
+      static_cast<int>(units.size()), total);
+  WriteSection("Translation units", units, false, &out);
+  WriteSection("Headers (inclusive parse time, times parsed)",
+               headers, true, &out);
+  WriteSection("Template instantiations (time, times instantiated)",
+               templates, true, &out);
+  if (headers.empty()) {
+    out.append("Per header and template times need clang (-ftime-trace).\n");
+  }
+  return out;
+}
+
+}  // namespace repobuild
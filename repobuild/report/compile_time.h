@@ -0,0 +1,24 @@
+// Copyright 2013
+// Author: Christopher Van Arsdale
+//
+// Compile time report, from the <object>.time-trace files written by
+// "make CC_TIME_TRACE=1" (see CCLibraryNode::WriteMakeHead).
+
+#ifndef _REPOBUILD_REPORT_COMPILE_TIME_H__
+#define _REPOBUILD_REPORT_COMPILE_TIME_H__
+
+#include <string>
+
+namespace repobuild {
+
+class Input;
+
+// Aggregates every trace under the object directory into the slowest
+// translation units, the slowest headers (by inclusive parse time) and the
+// slowest template instantiations. Headers and templates need clang's
+// -ftime-trace; gcc's -ftime-report only gives per translation unit totals.
+std::string CompileTimeReport(const Input& input);
+
+}  // namespace repobuild
+
+#endif  // _REPOBUILD_REPORT_COMPILE_TIME_H__